@@ -3,6 +3,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 
 #include "esp_log.h"
@@ -24,6 +25,13 @@
 #define GATT_CHARACTERISTIC_UUID 0xFF01
 #define GATT_HANDLE_COUNT 4
 
+// Sensor data published in the scan response, so that the hub can read it
+// without connecting: company ID (0xFFFF, reserved for tests), format version,
+// sequence number and sensor value, all little endian.
+#define ADV_SENSOR_COMPANY_ID 0xFFFF
+#define ADV_SENSOR_VERSION 0x01
+#define ADV_SENSOR_DATA_LEN 7
+
 typedef struct {
     uint16_t service_handle;
     esp_gatt_srvc_id_t service_id;
@@ -71,6 +79,33 @@ esp_ble_adv_data_t adv_data = {
     .flag = (ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT),
 };
 
+static uint8_t adv_sensor_data[ADV_SENSOR_DATA_LEN] = {
+    ADV_SENSOR_COMPANY_ID & 0xff,
+    ADV_SENSOR_COMPANY_ID >> 8,
+    ADV_SENSOR_VERSION,
+};
+
+static uint16_t adv_sensor_seq = 0;
+
+// The sensor data is updated from both read_temp_task and the GATT handler:
+// the sequence number and value must be advertised together.
+static StaticSemaphore_t adv_sensor_mutex_buf;
+static SemaphoreHandle_t adv_sensor_mutex = NULL;
+
+esp_ble_adv_data_t scan_rsp_data = {
+    .set_scan_rsp = true,
+    .include_name = false,
+    .include_txpower = false,
+    .appearance = 0x00,
+    .manufacturer_len = sizeof(adv_sensor_data),
+    .p_manufacturer_data = adv_sensor_data,
+    .service_data_len = 0,
+    .p_service_data = NULL,
+    .service_uuid_len = 0,
+    .p_service_uuid = NULL,
+    .flag = 0,
+};
+
 esp_ble_adv_params_t adv_params = {
     .adv_int_min = 0x20,
     .adv_int_max = 0x40,
@@ -115,6 +150,29 @@ static void update_conn_params(esp_bd_addr_t remote_bda)
     esp_ble_gap_update_conn_params(&conn_params);
 }
 
+static void update_adv_sensor_data(uint16_t val)
+{
+    uint8_t data[ADV_SENSOR_DATA_LEN];
+
+    xSemaphoreTake(adv_sensor_mutex, portMAX_DELAY);
+
+    adv_sensor_seq++;
+    adv_sensor_data[3] = adv_sensor_seq & 0xff;
+    adv_sensor_data[4] = adv_sensor_seq >> 8;
+    adv_sensor_data[5] = val & 0xff;
+    adv_sensor_data[6] = val >> 8;
+    memcpy(data, adv_sensor_data, sizeof(data));
+
+    xSemaphoreGive(adv_sensor_mutex);
+
+    // Configured out of the lock: it posts to the BTC task, which runs the
+    // GATT handler that takes the lock as well. The stack copies the data
+    // before returning, so a local copy will do.
+    esp_ble_adv_data_t rsp_data = scan_rsp_data;
+    rsp_data.p_manufacturer_data = data;
+    esp_ble_gap_config_adv_data(&rsp_data);
+}
+
 static void gap_handler(esp_gap_ble_cb_event_t event,
                         esp_ble_gap_cb_param_t* param)
 {
@@ -208,6 +266,7 @@ static void gatt_handler(esp_gatts_cb_event_t event,
     case ESP_GATTS_ADD_CHAR_DESCR_EVT:
         service_def.descr_handle = param->add_char_descr.attr_handle;
         esp_ble_gap_config_adv_data(&adv_data);
+        update_adv_sensor_data(sensor_val);
         break;
 
     case ESP_GATTS_CONNECT_EVT:
@@ -262,6 +321,10 @@ static void read_temp_task(void* arg)
         if (service_def.gatts_if > 0 && rc == 0) {
             *((uint16_t*)attr_val.attr_value) = res;
         }
+
+        if (rc == 0) {
+            update_adv_sensor_data(res);
+        }
     }
 }
 
@@ -298,6 +361,8 @@ void app_main(void)
     esp_bluedroid_enable();
     esp_ble_gap_set_device_name(DEV_NAME);
 
+    adv_sensor_mutex = xSemaphoreCreateMutexStatic(&adv_sensor_mutex_buf);
+
     esp_ble_gap_register_callback(gap_handler);
     esp_ble_gatts_register_callback(gatt_handler);
     esp_ble_gatts_app_register(0);
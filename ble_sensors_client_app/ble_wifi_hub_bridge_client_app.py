@@ -10,10 +10,10 @@ import udp_client
 import http_server
 
 
-read_data = [atomic.Atomic('-'),
-             atomic.Atomic('-'),
-             atomic.Atomic('-'),
-             atomic.Atomic('-')]
+read_data = [atomic.Atomic(None),
+             atomic.Atomic(None),
+             atomic.Atomic(None),
+             atomic.Atomic(None)]
 
 
 if __name__ == '__main__':
@@ -3,7 +3,6 @@
 import logging
 import functools
 import datetime
-import re
 
 import atomic
 import sensors
@@ -66,16 +65,14 @@ class RequestHandler(BaseHTTPRequestHandler):
         for sens_id in range(4):
             sensor_raw_value = sensor_values[sens_id].get()
 
-            sensor_raw_value_match = re.search(r'[0-9]+', sensor_raw_value)
-
             sensor_human_read_value = '-'
-            if sensor_raw_value_match:
-                sensor_num_val = int(sensor_raw_value_match.group())
-
+            if sensor_raw_value is not None:
                 sensor_human_read_value = sensors.sens_get_human_readable_value(
                     SENSOR_NAMES[sens_id],
-                    int(sensor_num_val)
+                    sensor_raw_value
                 )
+            else:
+                sensor_raw_value = '-'
 
             sensor_values_formatted.append(self.get_html_table_entry(
                 current_timestamp,
@@ -0,0 +1,235 @@
+import struct
+import collections
+
+
+# Mirrors ble_wifi_hub_bridge/main/sensors_wire.h
+MAGIC = 0xB5E5
+VERSION = 5
+
+TYPE_REQUEST = 1
+TYPE_RESPONSE = 2
+TYPE_ERROR = 3
+TYPE_DELTA_REQUEST = 4
+TYPE_NOT_MODIFIED = 5
+TYPE_SUBSCRIBE = 6
+TYPE_PUSH = 7
+TYPE_HISTORY_REQUEST = 8
+TYPE_HISTORY = 9
+TYPE_WINDOWS_REQUEST = 10
+TYPE_WINDOWS = 11
+
+FLAG_TRUNCATED = 1 << 0
+FLAG_MAX_AGE = 1 << 1
+
+RECORD_FLAG_STALE = 1 << 0
+
+AGE_UNKNOWN = 0xFFFFFFFF
+
+# magic, version, type, count, flags, hub_ms, snapshot_age_ms (max_age_ms or
+# from_ms in requests), cache_version, boot_id
+HEADER = struct.Struct('<HBBHHIIII')
+
+# id, value, seq, age_ms, flags
+RECORD = struct.Struct('<HHIIHxx')
+
+# id, from_ms, to_ms
+HISTORY_REQUEST = struct.Struct('<HII')
+
+# id, min, max, mean, start_ms, len_ms, count
+WINDOW = struct.Struct('<HHHHIII')
+
+
+# Version of the hub's cache: versions start over when the hub boots, with a
+# new boot ID.
+Version = collections.namedtuple('Version', ['boot_id', 'cache_version'])
+
+Record = collections.namedtuple('Record',
+                                ['id', 'value', 'seq', 'age_ms', 'flags'])
+
+Window = collections.namedtuple('Window', ['id', 'min', 'max', 'mean',
+                                           'start_ms', 'len_ms', 'count'])
+
+
+def encode_request(sensor_ids=(), max_age_ms=None) -> bytes:
+    '''
+    Encode a request of :param sensor_ids. No IDs requests all the sensors.
+    With :param max_age_ms, the hub reads the sensors older than that before
+    answering (or gives up after a timeout, see the ages of the records).
+
+    '''
+    flags = 0 if max_age_ms is None else FLAG_MAX_AGE
+
+    return (HEADER.pack(MAGIC, VERSION, TYPE_REQUEST, len(sensor_ids),
+                        flags, 0, max_age_ms or 0, 0, 0) +
+            b''.join(struct.pack('<H', i) for i in sensor_ids))
+
+
+def encode_subscribe_request(sensor_ids=()) -> bytes:
+    '''
+    Encode a subscription to :param sensor_ids, all the sensors if none. It
+    must be sent again before the hub's lease expires. The new samples are
+    then pushed to the socket it was sent from, and can be decoded with
+    decode_response.
+
+    '''
+    return (HEADER.pack(MAGIC, VERSION, TYPE_SUBSCRIBE, len(sensor_ids),
+                        0, 0, 0, 0, 0) +
+            b''.join(struct.pack('<H', i) for i in sensor_ids))
+
+
+def encode_delta_request(version: Version) -> bytes:
+    '''
+    Encode a request of the sensors that changed after :param version, the
+    last one returned by decode_response. All of them are returned if the hub
+    rebooted since then.
+
+    '''
+    return HEADER.pack(MAGIC, VERSION, TYPE_DELTA_REQUEST, 0,
+                       0, 0, 0, version.cache_version, version.boot_id)
+
+
+def encode_history_request(sensor_id: int, from_ms: int, to_ms: int) -> bytes:
+    '''
+    Encode a request of the values :param sensor_id took from :param from_ms
+    to :param to_ms, in hub uptime (see the hub_ms of the responses).
+
+    '''
+    return (HEADER.pack(MAGIC, VERSION, TYPE_HISTORY_REQUEST,
+                        1, 0, 0, 0, 0, 0) +
+            HISTORY_REQUEST.pack(sensor_id, from_ms, to_ms))
+
+
+def encode_windows_request(sensor_ids=(), from_ms=0) -> bytes:
+    '''
+    Encode a request of the aggregates (min., max., mean and count) of
+    :param sensor_ids, all the sensors if none, over the finished windows
+    that started at or after :param from_ms, in hub uptime (see the hub_ms of
+    the responses).
+
+    '''
+    return (HEADER.pack(MAGIC, VERSION, TYPE_WINDOWS_REQUEST, len(sensor_ids),
+                        0, 0, from_ms, 0, 0) +
+            b''.join(struct.pack('<H', i) for i in sensor_ids))
+
+
+def _decode_varint(data: bytes, pos: int) -> tuple:
+    val = 0
+    shift = 0
+
+    while True:
+        if pos >= len(data):
+            raise ValueError('truncated varint')
+
+        byte = data[pos]
+        pos += 1
+        val |= (byte & 0x7F) << shift
+        shift += 7
+
+        if not byte & 0x80:
+            return val, pos
+
+
+def _unzigzag(val: int) -> int:
+    return (val >> 1) ^ -(val & 1)
+
+
+def decode_history(data: bytes) -> tuple:
+    '''
+    Decode a history response into the sensor ID, a list of (at_ms, value)
+    samples, oldest first, and whether the response was truncated (i.e. the
+    samples after the last one must be requested again).
+
+    '''
+    if len(data) < HEADER.size + 2:
+        raise ValueError('response too short')
+
+    magic, version, msg_type, count, flags, *_ = HEADER.unpack_from(data)
+
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('unknown protocol')
+
+    if msg_type != TYPE_HISTORY:
+        raise ValueError('error response')
+
+    sensor_id, = struct.unpack_from('<H', data, HEADER.size)
+    pos = HEADER.size + 2
+
+    samples = []
+    for i in range(count):
+        at_ms, pos = _decode_varint(data, pos)
+        value, pos = _decode_varint(data, pos)
+
+        if samples:
+            at_ms = (samples[-1][0] + at_ms) & 0xFFFFFFFF
+            value = samples[-1][1] + _unzigzag(value)
+
+        samples.append((at_ms, value))
+
+    return sensor_id, samples, bool(flags & FLAG_TRUNCATED)
+
+
+def decode_windows(data: bytes) -> tuple:
+    '''
+    Decode a windows response into a list of windows, grouped by sensor and
+    oldest first, and whether the response was truncated (i.e. the sensors
+    after the last one must be requested again).
+
+    '''
+    if len(data) < HEADER.size:
+        raise ValueError('response too short')
+
+    magic, version, msg_type, count, flags, *_ = HEADER.unpack_from(data)
+
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('unknown protocol')
+
+    if msg_type != TYPE_WINDOWS:
+        raise ValueError('error response')
+
+    if len(data) < HEADER.size + count * WINDOW.size:
+        raise ValueError('truncated response')
+
+    windows = [Window(*WINDOW.unpack_from(data, HEADER.size + i * WINDOW.size))
+               for i in range(count)]
+
+    return windows, bool(flags & FLAG_TRUNCATED)
+
+
+def decode_response(data: bytes) -> tuple:
+    '''
+    Decode a response into the Version of the hub's cache and a list of
+    records, with their ages as of when the response was sent. The records
+    flagged RECORD_FLAG_STALE hold the last value read from a remote that is
+    lost since then. A "not modified" response has no records. Raise
+    ValueError if it is not a valid response.
+
+    '''
+    if len(data) < HEADER.size:
+        raise ValueError('response too short')
+
+    (magic, version, msg_type, count, _, _, snapshot_age_ms, cache_version,
+     boot_id) = HEADER.unpack_from(data)
+
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('unknown protocol')
+
+    if msg_type == TYPE_NOT_MODIFIED:
+        return Version(boot_id, cache_version), []
+
+    if msg_type not in (TYPE_RESPONSE, TYPE_PUSH):
+        raise ValueError('error response')
+
+    if len(data) < HEADER.size + count * RECORD.size:
+        raise ValueError('truncated response')
+
+    records = []
+    for i in range(count):
+        record = Record(*RECORD.unpack_from(data, HEADER.size + i * RECORD.size))
+
+        if record.age_ms != AGE_UNKNOWN:
+            record = record._replace(
+                age_ms=min(record.age_ms + snapshot_age_ms, AGE_UNKNOWN - 1))
+
+        records.append(record)
+
+    return Version(boot_id, cache_version), records
@@ -1,9 +1,17 @@
 #!/usr/bin/env python3
 
+import os
+import random
 import socket
+import struct
+import sys
 import time
 import logging
 
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+
+import sensors_wire
+
 
 logging.basicConfig(
     level=logging.DEBUG,
@@ -12,6 +20,9 @@ logging.basicConfig(
 
 counter = 0
 
+# Like the hub's, random at every start
+boot_id = random.getrandbits(32)
+
 
 def udp_server_listen(host='127.0.0.1', port=3333, timeout=5):
     global counter
@@ -30,13 +41,41 @@ def udp_server_listen(host='127.0.0.1', port=3333, timeout=5):
         while True:
             data, client_address = server_socket.recvfrom(1024)
 
-            decoded_data = data.decode()
-
-            logging.debug(f"received data from {client_address}: {decoded_data}")
-
-            response_data = int(decoded_data) + counter
-
-            server_socket.sendto(str(response_data).encode(), client_address)
+            if data[:2] == struct.pack('<H', sensors_wire.MAGIC):
+                logging.debug(f"received binary request from {client_address}")
+
+                records = b''.join(
+                    sensors_wire.RECORD.pack(sensor_id, sensor_id + counter,
+                                             counter + 1, 0, 0)
+                    for sensor_id in range(4))
+
+                response_data = sensors_wire.HEADER.pack(
+                    sensors_wire.MAGIC,
+                    sensors_wire.VERSION,
+                    sensors_wire.TYPE_RESPONSE,
+                    4, 0,
+                    int(time.monotonic() * 1000) & 0xFFFFFFFF,
+                    0,
+                    counter + 1,
+                    boot_id) + records
+
+                server_socket.sendto(response_data, client_address)
+
+            else:
+                decoded_data = data.decode()
+
+                logging.debug(
+                    f"received data from {client_address}: {decoded_data}")
+
+                if decoded_data.strip() == '*':
+                    response_data = ''.join(
+                        f'{sensor_id}={sensor_id + counter} age_ms=0\n'
+                        for sensor_id in range(4))
+                else:
+                    response_data = int(decoded_data) + counter
+
+                server_socket.sendto(str(response_data).encode(),
+                                     client_address)
 
             logging.debug(f"sent {response_data} to {client_address}")
 
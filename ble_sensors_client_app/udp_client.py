@@ -3,12 +3,19 @@ import time
 import logging
 
 import atomic
+import sensors_wire
 
 
 def udp_client_run(read_data: atomic.Atomic,
                    server_ip,
                    server_port,
-                   timeout):
+                   timeout,
+                   cache_version=None):
+    '''
+    Read the sensors that changed after :param cache_version (all of them if
+    None) and return the current version of the hub's cache.
+
+    '''
 
     logging.info('UDP polling for data')
 
@@ -19,17 +26,39 @@ def udp_client_run(read_data: atomic.Atomic,
 
         logging.debug('sending to {}:{}'.format(server_ip, server_port))
 
-        for sensor_id in range(4):
-            client_socket.sendto(str(sensor_id).encode(), (server_ip, server_port))
+        # A single binary request returns all the sensors, or just those that
+        # changed since the last one.
+        if cache_version is None:
+            request = sensors_wire.encode_request()
+        else:
+            request = sensors_wire.encode_delta_request(cache_version)
+
+        client_socket.sendto(request, (server_ip, server_port))
+
+        logging.debug('trying to read...')
+
+        # A full response can be larger than 1 KiB (one record per sensor);
+        # a short buffer would silently truncate it.
+        data, _ = client_socket.recvfrom(65535)
 
-            logging.debug('trying to read...')
+        cache_version, records = sensors_wire.decode_response(data)
 
-            data, _ = client_socket.recvfrom(1024)
-            dec_data = data.decode()
+        if not records:
+            logging.debug('not modified')
 
-            logging.debug('received data {}'.format(dec_data))
+        for record in records:
+            logging.debug('received {}'.format(record))
 
-            read_data[sensor_id].set(dec_data)
+            if record.id >= len(read_data):
+                continue
+
+            # A stale value is shown as unknown rather than as current
+            if record.flags & sensors_wire.RECORD_FLAG_STALE:
+                logging.debug('sensor {} is stale'.format(record.id))
+                read_data[record.id].set(None)
+
+            elif record.seq > 0:
+                read_data[record.id].set(record.value)
 
     except socket.timeout:
         logging.debug(f"timeout reached")
@@ -40,6 +69,8 @@ def udp_client_run(read_data: atomic.Atomic,
     finally:
         client_socket.close()
 
+    return cache_version
+
 
 
 def start_udp_client(read_data: atomic.Atomic,
@@ -49,9 +80,11 @@ def start_udp_client(read_data: atomic.Atomic,
     logging.info('starting UDP client')
 
     period = 1
+    cache_version = None
 
     while True:
-        udp_client_run(read_data, server_ip, server_port, timeout)
+        cache_version = udp_client_run(read_data, server_ip, server_port,
+                                       timeout, cache_version)
 
         logging.debug(f'UDP client finished, re-running in {period}')
 
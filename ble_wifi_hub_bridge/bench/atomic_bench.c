@@ -0,0 +1,164 @@
+/*
+ * Host benchmark of atomic_t (main/atomic.c).
+ *
+ * Compares the former implementation (one spinlock shared by every atomic_t
+ * in the program, like the portMUX it used) with the current one (C11
+ * atomics), with several threads:
+ *  - setting and getting their own atomic_t (unrelated sensors), and
+ *  - incrementing the same one (a shared counter), with a get/set pair under
+ *    the spinlock, with atomic_add() and with an atomic_cas() loop.
+ *
+ * Build and run:
+ *
+ *     cc -O2 -pthread -I../main -o atomic_bench atomic_bench.c ../main/atomic.c
+ *     ./atomic_bench [threads] [ops_per_thread]
+ *
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "atomic.h"
+
+// Keep each thread's own atomic_t in its own cache line
+struct padded_atomic {
+    atomic_t atm;
+    char pad[64 - sizeof(atomic_t)];
+};
+
+static pthread_spinlock_t spinlock;
+
+static struct padded_atomic own[64];
+static atomic_t shared;
+
+static long ops;
+
+static atomic_val_t old_get(const atomic_t* atm)
+{
+    atomic_val_t tmp;
+    pthread_spin_lock(&spinlock);
+    tmp.u32 = atomic_load_explicit(&atm->v, memory_order_relaxed);
+    pthread_spin_unlock(&spinlock);
+    return tmp;
+}
+
+static void old_set(atomic_t* atm, atomic_val_t val)
+{
+    pthread_spin_lock(&spinlock);
+    atomic_store_explicit(&atm->v, val.u32, memory_order_relaxed);
+    pthread_spin_unlock(&spinlock);
+}
+
+static void* own_old(void* args)
+{
+    atomic_t* atm = &own[(long)args].atm;
+    for (long i = 0; i < ops; i++) {
+        atomic_val_t v = {.u32 = (uint32_t)i};
+        old_set(atm, v);
+        old_get(atm);
+    }
+    return NULL;
+}
+
+static void* own_new(void* args)
+{
+    atomic_t* atm = &own[(long)args].atm;
+    for (long i = 0; i < ops; i++) {
+        atomic_val_t v = {.u32 = (uint32_t)i};
+        atomic_set(atm, v);
+        atomic_get(atm);
+    }
+    return NULL;
+}
+
+// The former API had no increment: a get/set pair under the lock
+static void* shared_old(void* args)
+{
+    (void)args;
+
+    for (long i = 0; i < ops; i++) {
+        pthread_spin_lock(&spinlock);
+        uint32_t v = atomic_load_explicit(&shared.v, memory_order_relaxed);
+        atomic_store_explicit(&shared.v, v + 1, memory_order_relaxed);
+        pthread_spin_unlock(&spinlock);
+    }
+    return NULL;
+}
+
+static void* shared_add(void* args)
+{
+    (void)args;
+
+    for (long i = 0; i < ops; i++) {
+        atomic_add(&shared, 1);
+    }
+    return NULL;
+}
+
+static void* shared_cas(void* args)
+{
+    (void)args;
+
+    for (long i = 0; i < ops; i++) {
+        atomic_val_t cur = atomic_get(&shared);
+        atomic_val_t next;
+        do {
+            next.u32 = cur.u32 + 1;
+        } while (!atomic_cas(&shared, &cur, next));
+    }
+    return NULL;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char* name, void* (*fn)(void*), long threads)
+{
+    pthread_t th[64];
+
+    atomic_set(&shared, (atomic_val_t){.u32 = 0});
+
+    double t0 = now_s();
+    for (long i = 0; i < threads; i++) {
+        pthread_create(&th[i], NULL, fn, (void*)i);
+    }
+    for (long i = 0; i < threads; i++) {
+        pthread_join(th[i], NULL);
+    }
+    double t1 = now_s();
+
+    printf("%-24s %8.1f Mops/s", name, threads * ops / (t1 - t0) / 1e6);
+    if (fn == shared_old || fn == shared_add || fn == shared_cas) {
+        printf("  (counter %s)",
+               atomic_get(&shared).u32 == (uint32_t)(threads * ops)
+                   ? "ok"
+                   : "WRONG");
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    long threads = argc > 1 ? atol(argv[1]) : 4;
+    ops = argc > 2 ? atol(argv[2]) : 2000000;
+
+    if (threads < 1 || threads > 64) {
+        fprintf(stderr, "1 to 64 threads\n");
+        return 1;
+    }
+
+    pthread_spin_init(&spinlock, PTHREAD_PROCESS_PRIVATE);
+
+    printf("%ld threads, %ld ops each\n", threads, ops);
+    run("own, global spinlock", own_old, threads);
+    run("own, C11 atomics", own_new, threads);
+    run("shared, global spinlock", shared_old, threads);
+    run("shared, atomic_add", shared_add, threads);
+    run("shared, atomic_cas", shared_cas, threads);
+    return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Host benchmark of the UDP sensor server request loop.
+ *
+ * Compares the former loop (blocking recvfrom() with SO_RCVTIMEO, one request
+ * per iteration, the timeout re-armed and the clock read after each request)
+ * with the current one (non-blocking socket, select() on a single deadline and
+ * all the pending requests drained per wakeup). A client thread sends bursts of
+ * requests and waits for all the responses; the server side counts its
+ * syscalls and the CPU time it used.
+ *
+ * Build and run:
+ *
+ *     cc -O2 -pthread -o udp_loop_bench udp_loop_bench.c
+ *     ./udp_loop_bench [bursts] [burst_size]
+ *
+ */
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PERIOD_MS 60000
+
+// Sent by the client when it's done, so the server loops end.
+#define STOP_REQUEST 'q'
+
+static unsigned long syscalls;
+
+static int bench_recvfrom(int sock, char* buf, size_t len,
+                          struct sockaddr_in* from, socklen_t* fromlen)
+{
+    syscalls++;
+    return recvfrom(sock, buf, len, 0, (struct sockaddr*)from, fromlen);
+}
+
+static int bench_sendto(int sock, const char* buf, size_t len,
+                        const struct sockaddr_in* to)
+{
+    syscalls++;
+    return sendto(sock, buf, len, 0, (const struct sockaddr*)to, sizeof(*to));
+}
+
+static uint32_t bench_now_ms(void)
+{
+    struct timespec ts;
+
+    syscalls++;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static struct timeval bench_timeval(uint32_t timeout_ms)
+{
+    struct timeval tv = {0};
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return tv;
+}
+
+static void bench_set_timeout(int sock, uint32_t timeout_ms)
+{
+    struct timeval tv = bench_timeval(timeout_ms);
+
+    syscalls++;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static int bench_answer(int sock, const char* req,
+                        const struct sockaddr_in* to)
+{
+    char response_str[32] = {0};
+    snprintf(response_str, sizeof(response_str), "sensor_value=%d\n",
+             req[0] - '0');
+    return bench_sendto(sock, response_str, sizeof(response_str), to);
+}
+
+/* Former loop: one request per recvfrom(), timeout re-armed each time. */
+static unsigned long old_loop(int sock)
+{
+    unsigned long handled = 0;
+    uint32_t start = bench_now_ms();
+    uint32_t left = PERIOD_MS;
+
+    bench_set_timeout(sock, left);
+
+    for (;;) {
+        char buf[128];
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+
+        int len = bench_recvfrom(sock, buf, sizeof(buf) - 1, &from, &fromlen);
+        if (len < 0) {
+            continue;
+        }
+        buf[len] = '\0';
+        if (buf[0] == STOP_REQUEST) {
+            break;
+        }
+
+        bench_answer(sock, buf, &from);
+        handled++;
+
+        uint32_t elapsed = bench_now_ms() - start;
+        if (elapsed >= PERIOD_MS) {
+            break;
+        }
+        left = PERIOD_MS - elapsed;
+        bench_set_timeout(sock, left);
+    }
+
+    return handled;
+}
+
+/* Current loop: select() on one deadline, drain all the pending requests. */
+static unsigned long new_loop(int sock)
+{
+    unsigned long handled = 0;
+    uint32_t deadline = bench_now_ms() + PERIOD_MS;
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    for (;;) {
+        int32_t left = (int32_t)(deadline - bench_now_ms());
+        if (left <= 0) {
+            break;
+        }
+
+        struct timeval tv = bench_timeval(left);
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(sock, &read_fds);
+
+        syscalls++;
+        int rc = select(sock + 1, &read_fds, NULL, NULL, &tv);
+        if (rc <= 0) {
+            continue;
+        }
+
+        for (;;) {
+            char buf[128];
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+
+            int len =
+                bench_recvfrom(sock, buf, sizeof(buf) - 1, &from, &fromlen);
+            if (len < 0) {
+                break;
+            }
+            buf[len] = '\0';
+            if (buf[0] == STOP_REQUEST) {
+                return handled;
+            }
+
+            bench_answer(sock, buf, &from);
+            handled++;
+        }
+    }
+
+    return handled;
+}
+
+struct client_args {
+    uint16_t port;
+    int bursts;
+    int burst_size;
+};
+
+static void* client(void* args)
+{
+    struct client_args* c = args;
+    struct sockaddr_in srv = {0};
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(c->port);
+    srv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval tv = bench_timeval(1000);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for (int b = 0; b < c->bursts; b++) {
+        for (int i = 0; i < c->burst_size; i++) {
+            char req = '0' + (i % 4);
+            sendto(sock, &req, 1, 0, (struct sockaddr*)&srv, sizeof(srv));
+        }
+
+        for (int i = 0; i < c->burst_size; i++) {
+            char buf[32];
+            if (recv(sock, buf, sizeof(buf), 0) < 0) {
+                break;
+            }
+        }
+    }
+
+    char req = STOP_REQUEST;
+    sendto(sock, &req, 1, 0, (struct sockaddr*)&srv, sizeof(srv));
+
+    close(sock);
+    return NULL;
+}
+
+static void run(const char* name, unsigned long (*loop)(int),
+                int bursts, int burst_size)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int rcvbuf = 1 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    socklen_t addrlen = sizeof(addr);
+    getsockname(sock, (struct sockaddr*)&addr, &addrlen);
+
+    struct client_args args = {
+        .port = ntohs(addr.sin_port),
+        .bursts = bursts,
+        .burst_size = burst_size,
+    };
+
+    syscalls = 0;
+
+    pthread_t th;
+    pthread_create(&th, NULL, client, &args);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    unsigned long handled = loop(sock);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+    pthread_join(th, NULL);
+    close(sock);
+
+    double cpu_ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%-8s %8lu requests, %5.2f syscalls/request, %7.0f ns CPU/request\n",
+           name,
+           handled,
+           handled ? (double)syscalls / handled : 0.0,
+           handled ? cpu_ns / handled : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    int bursts = argc > 1 ? atoi(argv[1]) : 2000;
+    int burst_size = argc > 2 ? atoi(argv[2]) : 32;
+
+    printf("%d bursts of %d requests\n", bursts, burst_size);
+    run("old loop", old_loop, bursts, burst_size);
+    run("new loop", new_loop, bursts, burst_size);
+    return 0;
+}
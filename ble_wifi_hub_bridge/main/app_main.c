@@ -3,40 +3,57 @@
 
 #include "ble_sensors_reader.h"
 #include "ble_conn_manager.h"
-
-struct gap_functor_params
-{
-    struct udp_sensor_server* udp_srvr;
-};
+#include "sensors_cache.h"
+#include "sensors_publisher.h"
+
+#if defined(CONFIG_BLE_SENSORS_READER_ADV_TRANSPORT)
+#define REMOTE_CONNECTIONLESS true
+#else
+#define REMOTE_CONNECTIONLESS false
+#endif
+
+// Sampling period of each sensor: the magnetic field and IR detectors back
+// door and presence sensors, so they must be fresher than the others. The IR
+// detector is an alarm input, so it's high priority as well.
+#define MAGNETIC_FIELD_PERIOD_MS 1000
+#define PHOTOCELL_PERIOD_MS 10000
+#define TEMP_DETECTOR_PERIOD_MS 60000
+#define IR_DETECTOR_PERIOD_MS 1000
 
 static struct udp_sensor_server udp_srvr = {0};
 
 static struct ble_remote_dev remote0 = {
     .name = "ESP32-TEST-0",
-    .remote_addr = {0}
+    .remote_addr = {0},
+    .connectionless = REMOTE_CONNECTIONLESS
 };
 
 static struct ble_remote_dev remote1 = {
     .name = "ESP32-TEST-1",
-    .remote_addr = {0}
+    .remote_addr = {0},
+    .connectionless = REMOTE_CONNECTIONLESS
 };
 
 static struct ble_remote_dev remote2 = {
     .name = "ESP32-TEST-2",
-    .remote_addr = {0}
+    .remote_addr = {0},
+    .connectionless = REMOTE_CONNECTIONLESS
 };
 
 static struct ble_remote_dev remote3 = {
     .name = "ESP32-TEST-3",
-    .remote_addr = {0}
+    .remote_addr = {0},
+    .connectionless = REMOTE_CONNECTIONLESS
 };
 
+// clang-format off
 static struct ble_remote_sensor app_remote_sensors[] = {
-    DECL_BLE_REMOTE_SENSOR(&remote0, SENSOR_MAGNETIC_FIELD),
-    DECL_BLE_REMOTE_SENSOR(&remote1, SENSOR_PHOTOCELL),
-    DECL_BLE_REMOTE_SENSOR(&remote2, SENSOR_TEMP_DETECTOR),
-    DECL_BLE_REMOTE_SENSOR(&remote3, SENSOR_IR_DETECTOR)
+    DECL_BLE_REMOTE_SENSOR(&remote0, SENSOR_MAGNETIC_FIELD, MAGNETIC_FIELD_PERIOD_MS),
+    DECL_BLE_REMOTE_SENSOR(&remote1, SENSOR_PHOTOCELL, PHOTOCELL_PERIOD_MS),
+    DECL_BLE_REMOTE_SENSOR(&remote2, SENSOR_TEMP_DETECTOR, TEMP_DETECTOR_PERIOD_MS),
+    DECL_BLE_REMOTE_SENSOR_PRIO(&remote3, SENSOR_IR_DETECTOR, IR_DETECTOR_PERIOD_MS, BLE_GATTC_APP_PRIO_HIGH)
 };
+// clang-format on
 
 static struct ble_sensors_reader ble_ev_handler_params = {
     .udp_sensor_server = &udp_srvr,
@@ -50,22 +67,39 @@ static struct gattc_gattc_profile_ev_functor gattc_profile_ev_functor = {
     .user_args = &ble_ev_handler_params
 };
 
-static struct gap_functor_params gap_func_params = {
-    .udp_srvr = &udp_srvr
+static struct adv_data_functor adv_data_functor = {
+    .handler = ble_sensors_rd_adv_data_handler,
+    .user_args = &ble_ev_handler_params
+};
+
+static struct sensor_refresh_functor sensor_refresh_functor = {
+    .handler = ble_sensors_rd_expedite,
+    .user_args = &ble_ev_handler_params
+};
+
+static struct udp_window_end_functor udp_window_end_functor = {
+    .handler = ble_sensors_rd_window_end,
+    .user_args = &ble_ev_handler_params
 };
 
 static void gap_ev_handler(esp_gap_ble_cb_event_t event,
                            esp_ble_gap_cb_param_t* param,
                            void* user_args)
 {
-    struct gap_functor_params* args = (struct gap_functor_params*)user_args;
+    struct ble_sensors_reader* ble_sens_rd =
+        (struct ble_sensors_reader*)user_args;
     const uint32_t period_ms = CONFIG_UDP_SENSOR_SERVER_TIMEOUT;
 
+    ble_sensors_rd_expire_stale(ble_sens_rd);
+
     switch (event)
     {
         case ESP_GAP_BLE_SCAN_RESULT_EVT:
         case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
-            udp_sensor_server_accept_requests(args->udp_srvr, period_ms);
+            // Remotes are missing: the window is shortened to scan sooner
+            if (!ble_conn_mngr_paused()) {
+                ble_sensors_rd_serve(ble_sens_rd, period_ms);
+            }
             break;
 
         default:
@@ -75,7 +109,7 @@ static void gap_ev_handler(esp_gap_ble_cb_event_t event,
 
 static struct gap_ev_functor gap_event_functor = {
     .handler = gap_ev_handler,
-    .user_args = &gap_func_params
+    .user_args = &ble_ev_handler_params
 };
 
 // clang-format off
@@ -88,9 +122,30 @@ BLE_CON_MNGR_GATTC_PROFILE_DEFINE(prf3, &remote3, 0x00ff, 0xff01, &gattc_profile
 struct ble_gattc_app* all_apps[] = {&prf0, &prf1, &prf2, &prf3};
 
 void app_main(void) {
+    sensors_cache_init();
+
+    // Remotes may share a sensor, so it can be registered already; the
+    // reader logs the ones that can't be registered when they are read.
+    for (size_t i = 0; i < ble_ev_handler_params.remote_sensors_size; i++) {
+        sensors_cache_register(app_remote_sensors[i].sensor);
+    }
+
     udp_sensor_server_setup(&udp_srvr, CONFIG_EXAMPLE_PORT);
 
+    udp_sensor_server_set_refresh_functor(&udp_srvr, &sensor_refresh_functor);
+
+    udp_sensor_server_set_window_end_functor(&udp_srvr,
+                                             &udp_window_end_functor);
+
+    sensors_publisher_setup();
+
     ble_conn_mngr_set_gap_ev_functor(&gap_event_functor);
 
+    ble_conn_mngr_set_adv_data_functor(&adv_data_functor);
+
+    ble_sensors_rd_setup_sched(&ble_ev_handler_params,
+                               all_apps,
+                               sizeof(all_apps) / sizeof(*all_apps));
+
     ble_conn_mngr_start(all_apps, sizeof(all_apps)/ sizeof(*all_apps));
 }
@@ -1,21 +1,24 @@
 #include "atomic.h"
 
-#include "freertos/FreeRTOS.h"
-
-static portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
-
 atomic_val_t atomic_get(const atomic_t* atm)
 {
     atomic_val_t tmp;
-    portENTER_CRITICAL(&spinlock);
-    tmp = atm->v;
-    portEXIT_CRITICAL(&spinlock);
+    tmp.u32 = atomic_load(&atm->v);
     return tmp;
 }
 
 void atomic_set(atomic_t* atm, atomic_val_t val)
 {
-    portENTER_CRITICAL(&spinlock);
-    atm->v = val;
-    portEXIT_CRITICAL(&spinlock);
+    atomic_store(&atm->v, val.u32);
+}
+
+uint32_t atomic_add(atomic_t* atm, uint32_t inc)
+{
+    return atomic_fetch_add(&atm->v, inc);
+}
+
+bool atomic_cas(atomic_t* atm, atomic_val_t* expected, atomic_val_t desired)
+{
+    return atomic_compare_exchange_strong(
+        &atm->v, &expected->u32, desired.u32);
 }
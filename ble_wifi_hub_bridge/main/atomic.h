@@ -1,6 +1,8 @@
 #ifndef ATOMIC_H
 #define ATOMIC_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef union 
@@ -10,13 +12,36 @@ typedef union
     uint16_t u16;
 } atomic_val_t;
 
+/*
+ * Lock-free: 32 bit loads, stores and compare-and-swap are native (S32C1I on
+ * the ESP32), so each atomic_t is independent of the rest.
+ *
+ */
 typedef struct 
 {
-    atomic_val_t v;
+    _Atomic uint32_t v;
 } atomic_t;
 
+_Static_assert(sizeof(atomic_val_t) == sizeof(uint32_t),
+               "atomic_val_t must fit in 32 bits");
+
 atomic_val_t atomic_get(const atomic_t* atm);
 
 void atomic_set(atomic_t* atm, atomic_val_t val);
 
-#endif /* ATOMIC_H */
\ No newline at end of file
+/**
+ * @brief Add @p inc to @p atm (wrapping around).
+ *
+ * @return The value before the addition.
+ */
+uint32_t atomic_add(atomic_t* atm, uint32_t inc);
+
+/**
+ * @brief Set @p atm to @p desired if it's @p expected.
+ *
+ * @param expected Set to the current value if it's not the expected one.
+ * @return Whether @p atm was set.
+ */
+bool atomic_cas(atomic_t* atm, atomic_val_t* expected, atomic_val_t desired);
+
+#endif /* ATOMIC_H */
@@ -7,6 +7,10 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+
+#include "esp_timer.h"
 
 #include "nvs.h"
 #include "nvs_flash.h"
@@ -21,10 +25,84 @@
 
 #include "ble_conn_manager.h"
 #include "ble_conn_manager_context.h"
+#include "ble_handle_cache.h"
+#include "spsc_ring.h"
 #include "log_helpers.h"
 
 #define TAG "CONN_MNGR"
 #define BLE_MTU 500
+#define BLE_CCCD_NOTIFY_ENABLE 0x0001
+
+// Largest value that can be read or notified without exchanging the MTU (the
+// ATT header of a notification takes 3 bytes).
+#define BLE_DEF_MTU_MAX_VALUE_LEN (ESP_GATT_DEF_BLE_MTU_SIZE - 3)
+
+#if defined(CONFIG_BLE_CONN_MNGR_HANDLE_CACHE)
+#define BLE_HANDLE_CACHE_ENABLED true
+#else
+#define BLE_HANDLE_CACHE_ENABLED false
+#endif
+
+// With the event task, the BLE stack callbacks just queue their events, so
+// that the BT host task is never held by the event loop (e.g. by the UDP
+// server).
+#if defined(CONFIG_BLE_CONN_MNGR_EVENT_TASK)
+#define BLE_EVENT_TASK_ENABLED true
+#define BLE_EVENT_RING_SIZE CONFIG_BLE_CONN_MNGR_EVENT_RING_SIZE
+#else
+#define BLE_EVENT_TASK_ENABLED false
+#define BLE_EVENT_RING_SIZE 1
+#endif
+
+_Static_assert((BLE_EVENT_RING_SIZE & (BLE_EVENT_RING_SIZE - 1)) == 0,
+               "the BLE event ring size must be a power of two");
+
+#define BLE_EVENT_TASK_STACK_SIZE 4096
+#define BLE_EVENT_TASK_PRIORITY 5
+
+// Event task notification bits.
+#define BLE_EVENT_TASK_EVENTS (1 << 0)   // Events queued in the ring
+#define BLE_EVENT_TASK_RESUME (1 << 1)   // The pause is over
+#define BLE_EVENT_TASK_SCHEDULE (1 << 2) // An app. was expedited
+
+// Lifecycle events a connection can have pending before the event task gets
+// to them: connect, open, discovery cmpl., the reply to the request in
+// progress, close and disconnect. Each request is only issued by the event
+// task once the previous one is answered, so there are no more.
+#define BLE_EVENT_LIFECYCLE_PER_CONN 6
+
+// GAP lifecycle events that can be pending: scan params. set, scan start and
+// stop cmpl., and the scan end.
+#define BLE_EVENT_LIFECYCLE_GAP 4
+
+// Ring slots kept for the lifecycle events, enough for all the connections.
+// Notifications are dropped when no more than these are free, and scan
+// results when no more than these and BLE_EVENT_RING_NOTIFY_SLOTS are.
+#define BLE_EVENT_RING_RESERVED                                                 \
+    (CONFIG_BLE_CONN_MNGR_MAX_CONNECTIONS * BLE_EVENT_LIFECYCLE_PER_CONN +      \
+     BLE_EVENT_LIFECYCLE_GAP)
+#define BLE_EVENT_RING_NOTIFY_SLOTS 4
+
+_Static_assert(!BLE_EVENT_TASK_ENABLED ||
+                   BLE_EVENT_RING_SIZE >
+                       BLE_EVENT_RING_RESERVED + BLE_EVENT_RING_NOTIFY_SLOTS,
+               "the BLE event ring is too small for the reserved slots, raise "
+               "CONFIG_BLE_CONN_MNGR_EVENT_RING_SIZE");
+
+// Largest char. value that can be received (the ATT MTU minus the opcode).
+#define BLE_MAX_VALUE_LEN (BLE_MTU - 1)
+
+// Scan interval and window, in 0.625 ms units. Background scanning shares the
+// radio with the connections, so it only listens ~8% of the time.
+#if defined(CONFIG_BLE_CONN_MNGR_BACKGROUND_SCAN)
+#define BLE_BACKGROUND_SCAN_ENABLED true
+#define BLE_SCAN_INTERVAL 0x190
+#define BLE_SCAN_WINDOW 0x20
+#else
+#define BLE_BACKGROUND_SCAN_ENABLED false
+#define BLE_SCAN_INTERVAL 0x50
+#define BLE_SCAN_WINDOW 0x30
+#endif
 
 #define ARRAY_EXPAND_6(arr) arr[0], arr[1], arr[2], arr[3], arr[4], arr[5]
 #define ARRAY_FMT_STR_6 "%02x %02x %02x %02x %02x %02x"
@@ -43,49 +121,187 @@ struct ble_conn_manager_ctx ble_conn_mngr_ctx = {
     .apps = NULL,
     .apps_cnt = 0,
     .curr_prf_idx = 0,
+    .max_conns = CONFIG_BLE_CONN_MNGR_MAX_CONNECTIONS,
     .scanning = false,
-    .opening = false,
-    .closing = false,
     .ble_scan_params = {
         .scan_type = BLE_SCAN_TYPE_ACTIVE,
         .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
         .scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL,
-        .scan_interval = 0x50,
-        .scan_window = 0x30,
+        .scan_interval = BLE_SCAN_INTERVAL,
+        .scan_window = BLE_SCAN_WINDOW,
         .scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE
     }
 };
 
+enum ble_conn_mngr_event_type
+{
+    BLE_CONN_MNGR_EVENT_GATTC,
+    BLE_CONN_MNGR_EVENT_GAP
+};
+
+/*
+ * How an event is treated when the ring is almost full. Scan results are
+ * dropped first, as the remote will be scanned again, and notifications next,
+ * as a newer value follows. The rest (open, close, disconnect, read
+ * completions...) drive the apps.' state machine, so they have slots of their
+ * own; if even those are taken (the event task is stuck), the ring is flagged
+ * as overflowed and the event task resynchronizes the apps.
+ *
+ */
+enum ble_conn_mngr_event_class
+{
+    BLE_EVENT_CLASS_SCAN_RESULT,
+    BLE_EVENT_CLASS_NOTIFY,
+    BLE_EVENT_CLASS_LIFECYCLE
+};
+
+/*
+ * A BLE stack callback invocation. The value of read and notify events is
+ * only pointed to by their parameters, so it's copied as well.
+ *
+ */
+struct ble_conn_mngr_event
+{
+    enum ble_conn_mngr_event_type type;
+    union {
+        struct {
+            esp_gattc_cb_event_t event;
+            esp_gatt_if_t gattc_if;
+            esp_ble_gattc_cb_param_t param;
+        } gattc;
+
+        struct {
+            esp_gap_ble_cb_event_t event;
+            esp_ble_gap_cb_param_t param;
+        } gap;
+    };
+    uint8_t value[BLE_MAX_VALUE_LEN];
+};
+
+static struct ble_conn_mngr_event ble_conn_mngr_events[BLE_EVENT_RING_SIZE];
+
 static esp_err_t ble_conn_mngr_gap_start_scanning(
     struct ble_conn_manager_ctx* ctx);
 
-static esp_err_t ble_conn_mngr_gattc_open(struct ble_conn_manager_ctx* ctx,
-                                          struct ble_gattc_app* app)
+static void ble_conn_mngr_hcache_invalidate(struct ble_gattc_app* app)
+{
+    if (!BLE_HANDLE_CACHE_ENABLED || !app->hcache_valid) {
+        return;
+    }
+
+    LOG_INF("invalidating cached handles of %s", app->target_remote->name);
+
+    app->hcache_valid = false;
+    memset(&app->hcache, 0, sizeof(app->hcache));
+
+    esp_err_t rc = ble_handle_cache_erase(app->target_remote->remote_addr);
+    if (rc != ESP_OK && rc != ESP_ERR_NVS_NOT_FOUND) {
+        LOG_ERR("could not erase handles of %s, error %d",
+                app->target_remote->name,
+                rc);
+    }
+}
+
+static void ble_conn_mngr_hcache_load(struct ble_gattc_app* app)
+{
+    if (!BLE_HANDLE_CACHE_ENABLED) {
+        return;
+    }
+
+    esp_err_t rc = ble_handle_cache_load(app->target_remote->remote_addr,
+                                         &app->hcache);
+    if (rc != ESP_OK && rc != ESP_ERR_NOT_FOUND) {
+        LOG_ERR("could not load handles of %s, error %d",
+                app->target_remote->name,
+                rc);
+    }
+
+    app->hcache_valid = (rc == ESP_OK);
+
+    // The entry might have been stored by a profile with other chars.
+    if (app->hcache_valid &&
+        app->hcache.char_cnt != app->target_service.target_chars_cnt) {
+        ble_conn_mngr_hcache_invalidate(app);
+    }
+}
+
+static void ble_conn_mngr_hcache_store(struct ble_gattc_app* app)
+{
+    if (!BLE_HANDLE_CACHE_ENABLED || !app->hcache_valid) {
+        return;
+    }
+
+    esp_err_t rc = ble_handle_cache_store(app->target_remote->remote_addr,
+                                          &app->hcache);
+    if (rc != ESP_OK) {
+        LOG_ERR("could not store handles of %s, error %d",
+                app->target_remote->name,
+                rc);
+    }
+}
+
+/*
+ * The MTU only needs to be exchanged if the char. value might not fit in the
+ * default one, that is, if its length is not known yet or it's too big.
+ *
+ */
+static bool ble_conn_mngr_hcache_mtu_needed(struct ble_gattc_app* app)
+{
+    return !app->hcache_hit ||
+           app->hcache.max_value_len == 0 ||
+           app->hcache.max_value_len > BLE_DEF_MTU_MAX_VALUE_LEN;
+}
+
+/*
+ * Connections are established one at a time (the controller can only initiate
+ * one at once), but up to ctx->max_conns of them can be in progress.
+ *
+ */
+static esp_err_t ble_conn_mngr_gattc_check_can_open(
+    struct ble_conn_manager_ctx* ctx)
 {
-    if (ctx->opening) {
-        LOG_ERR("could not open, currently opening");
+    if (ble_conn_mngr_count_apps_in_state(ctx, BLE_GATTC_APP_OPENING) > 0) {
+        LOG_DBG("could not open, currently opening");
         return ESP_ERR_INVALID_STATE;
     }
 
-    if (ctx->closing) {
-        LOG_ERR("could not open, currently closing");
+    if (ble_conn_mngr_count_connected_apps(ctx) >= ctx->max_conns) {
+        LOG_DBG("could not open, no connections available");
         return ESP_ERR_INVALID_STATE;
     }
 
-    if (ctx->scanning) {
-        LOG_ERR("could not open, currently scaning");
+    if (ctx->scanning && !BLE_BACKGROUND_SCAN_ENABLED) {
+        LOG_DBG("could not open, currently scaning");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t ble_conn_mngr_gattc_open(struct ble_conn_manager_ctx* ctx,
+                                          struct ble_gattc_app* app)
+{
+    esp_err_t rc = ble_conn_mngr_gattc_check_can_open(ctx);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+
+    if (app->state != BLE_GATTC_APP_IDLE) {
+        LOG_ERR("could not open, app. %d in state %d",
+                app->app_id,
+                app->state);
         return ESP_ERR_INVALID_STATE;
     }
 
-    esp_err_t rc = esp_ble_gattc_open(app->gattc_if,
-                                      app->target_remote->remote_addr,
-                                      app->target_remote->addr_type,
-                                      true);
+    rc = esp_ble_gattc_open(app->gattc_if,
+                            app->target_remote->remote_addr,
+                            app->target_remote->addr_type,
+                            true);
     if (rc == ESP_OK) {
         LOG_DBG("opening app. id %d, remote %s",
                 app->app_id,
                 app->target_remote->name);
-        ctx->opening = true;
+        app->state = BLE_GATTC_APP_OPENING;
     } else {
         LOG_ERR("could not open, error %d", rc);
     }
@@ -95,8 +311,11 @@ static esp_err_t ble_conn_mngr_gattc_open(struct ble_conn_manager_ctx* ctx,
 static esp_err_t ble_conn_mngr_gattc_close(struct ble_conn_manager_ctx* ctx,
                                            struct ble_gattc_app* app)
 {
-    if (ctx->opening || ctx->closing || ctx->scanning) {
-        LOG_ERR("could not close, currently opening, closing or scaning");
+    if (app->state != BLE_GATTC_APP_OPEN &&
+        app->state != BLE_GATTC_APP_SUBSCRIBED) {
+        LOG_ERR("could not close app. %d, state %d",
+                app->app_id,
+                app->state);
         return ESP_ERR_INVALID_STATE;
     }
 
@@ -106,14 +325,68 @@ static esp_err_t ble_conn_mngr_gattc_close(struct ble_conn_manager_ctx* ctx,
                 app->virt_conn_id,
                 app->app_id,
                 app->target_remote->name);
-        ctx->closing = true;
+        app->state = BLE_GATTC_APP_CLOSING;
+    }
+    return rc;
+}
+
+static esp_err_t ble_conn_mngr_gattc_subscribe(
+    struct ble_conn_manager_ctx* ctx,
+    struct ble_gattc_app* app)
+{
+    if (app->state != BLE_GATTC_APP_OPEN) {
+        LOG_ERR("could not subscribe app. %d, state %d",
+                app->app_id,
+                app->state);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (ctx->max_conns < 2) {
+        LOG_WRN("subscriptions need 2 connections at least, reading instead");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // Always keep one connection for the apps. that are polled.
+    size_t subscribed = ble_conn_mngr_count_apps_in_state(
+        ctx, BLE_GATTC_APP_SUBSCRIBED);
+    if (subscribed + 1 >= ctx->max_conns) {
+        LOG_DBG("no connections left to subscribe app. %d", app->app_id);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t rc = esp_ble_gattc_register_for_notify(
+        app->gattc_if,
+        app->target_remote->remote_addr,
+        app->target_service.target_chars[0].handle);
+    if (rc == ESP_OK) {
+        LOG_DBG("subscribing app. %d to remote %s",
+                app->app_id,
+                app->target_remote->name);
+        app->state = BLE_GATTC_APP_SUBSCRIBING;
     }
     return rc;
 }
 
+static void ble_conn_mngr_gattc_abort_subscription(
+    struct ble_conn_manager_ctx* ctx,
+    struct ble_gattc_app* app)
+{
+    app->state = BLE_GATTC_APP_OPEN;
+
+    esp_err_t rc = ble_conn_mngr_gattc_close(ctx, app);
+    if (rc != ESP_OK) {
+        LOG_ERR("could not close connection, error %d", rc);
+    }
+}
+
 static esp_err_t ble_conn_mngr_gattc_open_next_app(
     struct ble_conn_manager_ctx* ctx)
 {
+    esp_err_t rc = ble_conn_mngr_gattc_check_can_open(ctx);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+
     struct ble_gattc_app* next = ble_conn_mngr_next_prf(ctx);
     if (next == NULL) {
         LOG_DBG("no profiles available");
@@ -123,7 +396,7 @@ static esp_err_t ble_conn_mngr_gattc_open_next_app(
 
     assert(next->target_remote->found);
 
-    esp_err_t rc = ble_conn_mngr_gattc_open(ctx, next);
+    rc = ble_conn_mngr_gattc_open(ctx, next);
     if (rc != ESP_OK) {
         LOG_DBG("could not connect to %d, error %d", next->app_id, rc);
     }
@@ -131,16 +404,37 @@ static esp_err_t ble_conn_mngr_gattc_open_next_app(
     return rc;
 }
 
-static void ble_conn_mngr_gattc_handle_reg_ev(struct ble_conn_manager_ctx* ctx,
-                                              struct ble_gattc_app* app,
-                                              esp_ble_gattc_cb_param_t* param)
+/*
+ * Yield the event loop once an app. has finished with its connection, either
+ * because it has closed it or because it just keeps it to be notified.
+ *
+ */
+static void ble_conn_mngr_gattc_yield(struct ble_conn_manager_ctx* ctx)
 {
     esp_err_t rc = ESP_OK;
-    if (ble_conn_mngr_all_remotes_found(ctx)) {
+    if (BLE_BACKGROUND_SCAN_ENABLED) {
+        // Known remotes keep being polled while the missing ones are
+        // searched for.
         rc = ble_conn_mngr_gattc_open_next_app(ctx);
         if (rc != ESP_OK) {
-            LOG_ERR("could not open next app., error %d", rc);
+            LOG_DBG("could not open next app., error %d", rc);
         }
+
+        rc = ble_conn_mngr_gap_start_scanning(ctx);
+        if (rc != ESP_OK) {
+            LOG_ERR("could not start scannig, error %d", rc);
+        }
+    } else if (ble_conn_mngr_all_remotes_found(ctx)) {
+        LOG_DBG("all remotes found, opening next app.");
+
+        // Not being able to open another app. is expected while other
+        // connections are still in progress.
+        rc = ble_conn_mngr_gattc_open_next_app(ctx);
+        if (rc != ESP_OK) {
+            LOG_DBG("could not open next app., error %d", rc);
+        }
+    } else if (ble_conn_mngr_count_busy_apps(ctx) > 0) {
+        LOG_DBG("not all remotes found, scanning once all apps. are closed");
     } else {
         rc = ble_conn_mngr_gap_start_scanning(ctx);
         if (rc != ESP_OK) {
@@ -149,6 +443,34 @@ static void ble_conn_mngr_gattc_handle_reg_ev(struct ble_conn_manager_ctx* ctx,
     }
 }
 
+static void ble_conn_mngr_gattc_handle_reg_ev(struct ble_conn_manager_ctx* ctx,
+                                              struct ble_gattc_app* app,
+                                              esp_ble_gattc_cb_param_t* param)
+{
+    if (BLE_BACKGROUND_SCAN_ENABLED) {
+        ble_conn_mngr_gattc_yield(ctx);
+        return;
+    }
+
+    esp_err_t rc = ESP_OK;
+    if (ble_conn_mngr_all_remotes_found(ctx)) {
+        rc = ble_conn_mngr_gattc_open_next_app(ctx);
+        if (rc == ESP_OK) {
+            return;
+        }
+
+        if (!ble_conn_mngr_scan_needed(ctx)) {
+            LOG_ERR("could not open next app., error %d", rc);
+            return;
+        }
+    }
+
+    rc = ble_conn_mngr_gap_start_scanning(ctx);
+    if (rc != ESP_OK) {
+        LOG_ERR("could not start scannig, error %d", rc);
+    }
+}
+
 static void ble_conn_mngr_gattc_handle_open_ev(struct ble_conn_manager_ctx* ctx,
                                                struct ble_gattc_app* app,
                                                esp_ble_gattc_cb_param_t* param)
@@ -158,32 +480,82 @@ static void ble_conn_mngr_gattc_handle_open_ev(struct ble_conn_manager_ctx* ctx,
             app->target_remote->name,
             param->open.status);
 
-    ctx->opening = false;
-
     if (param->open.status != ESP_GATT_OK) {
         LOG_ERR("could not open device %s, status = 0x%x",
                  app->target_remote->name,
                  param->open.status
         );
+        app->state = BLE_GATTC_APP_IDLE;
+
+        if (app->gattc_profile_ev_functor != NULL) {
+            app->gattc_profile_ev_functor->handler(
+                app,
+                ESP_GATTC_OPEN_EVT,
+                param,
+                app->gattc_profile_ev_functor->user_args);
+        }
+
+        // The attempt is over (see ble_gattc_app::expedited)
+        app->expedited = false;
         return;
     }
 
+    app->state = BLE_GATTC_APP_OPEN;
+    app->virt_conn_open = true;
     app->virt_conn_id = param->open.conn_id;
 
-    esp_err_t rc = esp_ble_gatt_set_local_mtu(BLE_MTU);
+    app->hcache_hit = app->hcache_valid;
+    app->stats.connections++;
+
+    // Now that the connection is established, the next one can be initiated
+    // while this one exchanges its MTU, discovers its services etc.
+    esp_err_t rc = ble_conn_mngr_gattc_open_next_app(ctx);
     if (rc != ESP_OK) {
-        LOG_ERR("error %d trying to set mtu", rc);
-        ble_conn_mngr_gattc_close(ctx, app);
-    } else {
-        LOG_DBG("local mtu set succesfully");
+        LOG_DBG("not opening another app. (%d)", rc);
+    }
 
+    if (ble_conn_mngr_hcache_mtu_needed(app)) {
         rc = esp_ble_gattc_send_mtu_req(app->gattc_if, app->virt_conn_id);
         if (rc != ESP_OK) {
             LOG_ERR("error %d trying to req. config. mtu", rc);
             ble_conn_mngr_gattc_close(ctx, app);
-        } else {
-            LOG_DBG("local mtu request sent succesfully");
+            return;
         }
+        LOG_DBG("local mtu request sent succesfully");
+    } else {
+        app->stats.saved_mtu_exchanges++;
+    }
+
+    // Only the MTU exchange is a round trip saved: with
+    // BT_GATTC_CACHE_NVS_FLASH, the stack doesn't rediscover the remote over
+    // the air anyway, so a hit just skips lookups in its attribute table.
+    LOG_INF("%s: connection %lu, handle cache %s, %lu MTU exchanges saved",
+            app->target_remote->name,
+            app->stats.connections,
+            app->hcache_hit ? "hit" : "miss",
+            app->stats.saved_mtu_exchanges);
+
+    if (!app->hcache_hit) {
+        return;
+    }
+
+    // The handles are known, so go straight to the app. without waiting for
+    // the service discovery. Any request the app. issues is queued by the
+    // stack until the discovery (if any) finishes.
+    app->target_service.found = true;
+    app->target_service.start_handle = app->hcache.start_handle;
+    app->target_service.end_handle = app->hcache.end_handle;
+    for (size_t i = 0; i < app->target_service.target_chars_cnt; i++) {
+        app->target_service.target_chars[i].handle =
+            app->hcache.char_handles[i];
+    }
+
+    if (app->gattc_profile_ev_functor != NULL) {
+        app->gattc_profile_ev_functor->handler(
+            app,
+            ESP_GATTC_SEARCH_CMPL_EVT,
+            param,
+            app->gattc_profile_ev_functor->user_args);
     }
 }
 
@@ -211,6 +583,11 @@ static void ble_conn_mngr_gattc_handle_dis_srvc_cmpl(
     esp_gattc_cb_event_t event,
     esp_ble_gattc_cb_param_t* param)
 {
+    if (app->state != BLE_GATTC_APP_OPEN || app->hcache_hit) {
+        LOG_DBG("%s: service search not needed", app->target_remote->name);
+        return;
+    }
+
     LOG_DBG("searching for service");
 
     esp_err_t rc = esp_ble_gattc_search_service(
@@ -260,19 +637,20 @@ static void ble_conn_mngr_gattc_handle_srv_search_cmpl(
         return;
     }
 
+    struct ble_gattc_service* srv = &app->target_service;
     uint16_t count = 0;
     esp_gatt_status_t rc = esp_ble_gattc_get_attr_count(
         app->gattc_if,
         app->virt_conn_id,
         ESP_GATT_DB_CHARACTERISTIC,
-        app->target_service.start_handle,
-        app->target_service.end_handle,
+        srv->start_handle,
+        srv->end_handle,
         ESP_GATT_INVALID_HANDLE,
         &count
     );
 
-    if (rc != ESP_GATT_OK || count != 1) {
-        LOG_ERR("could not get chars. count, error %d", rc);
+    if (rc != ESP_GATT_OK || count < srv->target_chars_cnt) {
+        LOG_ERR("could not get chars. count (%d), error %d", count, rc);
         rc = ble_conn_mngr_close(app);
         if (rc != ESP_OK) {
             LOG_ERR("error %d trying to close connection", rc);
@@ -280,31 +658,56 @@ static void ble_conn_mngr_gattc_handle_srv_search_cmpl(
         return;
     }
 
-    esp_gattc_char_elem_t char_res = {0};
-    rc = esp_ble_gattc_get_char_by_uuid(
-        app->gattc_if,
-        app->virt_conn_id,
-        app->target_service.start_handle,
-        app->target_service.end_handle,
-        app->target_service.target_char.uuid,
-        &char_res,
-        &count);
-
-    uint16_t char_uuid = app->target_service.target_char.uuid.uuid.uuid16;
-    if (rc != ESP_GATT_OK || count != 1) {
-        LOG_ERR("error or unexpected count (%d), error %d",
-                rc,
-                count);
-        rc = ble_conn_mngr_close(app);
-        if (rc != ESP_OK) {
-            LOG_ERR("error %d trying to close connection", rc);
+    for (size_t i = 0; i < srv->target_chars_cnt; i++) {
+        esp_gattc_char_elem_t char_res = {0};
+        count = 1;
+        rc = esp_ble_gattc_get_char_by_uuid(
+            app->gattc_if,
+            app->virt_conn_id,
+            srv->start_handle,
+            srv->end_handle,
+            srv->target_chars[i].uuid,
+            &char_res,
+            &count);
+
+        uint16_t char_uuid = srv->target_chars[i].uuid.uuid.uuid16;
+        if (rc != ESP_GATT_OK || count != 1) {
+            LOG_ERR("char. %04x: error %d or unexpected count (%d)",
+                    char_uuid,
+                    rc,
+                    count);
+            rc = ble_conn_mngr_close(app);
+            if (rc != ESP_OK) {
+                LOG_ERR("error %d trying to close connection", rc);
+            }
+            return;
+        } else {
+            LOG_INF("char. %04x found", char_uuid);
         }
-        return;
-    } else {
-        LOG_INF("char. %04x found", char_uuid);
+
+        srv->target_chars[i].handle = char_res.char_handle;
     }
 
-    app->target_service.target_char.handle = char_res.char_handle;
+    bool hcache_outdated = !app->hcache_valid ||
+                           app->hcache.char_cnt != srv->target_chars_cnt ||
+                           app->hcache.start_handle != srv->start_handle ||
+                           app->hcache.end_handle != srv->end_handle;
+    for (size_t i = 0; i < srv->target_chars_cnt && !hcache_outdated; i++) {
+        hcache_outdated =
+            app->hcache.char_handles[i] != srv->target_chars[i].handle;
+    }
+
+    if (hcache_outdated) {
+        memset(&app->hcache, 0, sizeof(app->hcache));
+        app->hcache.start_handle = srv->start_handle;
+        app->hcache.end_handle = srv->end_handle;
+        app->hcache.char_cnt = srv->target_chars_cnt;
+        for (size_t i = 0; i < srv->target_chars_cnt; i++) {
+            app->hcache.char_handles[i] = srv->target_chars[i].handle;
+        }
+        app->hcache_valid = true;
+        ble_conn_mngr_hcache_store(app);
+    }
 
     if (app != NULL && app->gattc_profile_ev_functor != NULL) {
         app->gattc_profile_ev_functor->handler(
@@ -319,7 +722,7 @@ static void ble_conn_mngr_gattc_handle_close_ev(
 {
     LOG_DBG("%d: CLOSE", app->app_id);
 
-    ctx->closing = false;
+    app->state = BLE_GATTC_APP_IDLE;
 
     app->virt_conn_id = VIRT_CONN_ID_CLOSED;
     app->virt_conn_open = false;
@@ -332,22 +735,104 @@ static void ble_conn_mngr_gattc_handle_close_ev(
             app->gattc_profile_ev_functor->user_args);
     }
 
+    // The attempt is over (see ble_gattc_app::expedited)
+    app->expedited = false;
+
     // Notice this is here because it's expected that there will be only one
     // virtual connection (app.) per physical device. TODO Possibly move it to
     // the close handler.
-    esp_err_t rc = ESP_OK;
-    if (ble_conn_mngr_all_remotes_found(ctx)) {
-        LOG_DBG("all remotes found, opening next app.");
+    ble_conn_mngr_gattc_yield(ctx);
+}
 
-        rc = ble_conn_mngr_gattc_open_next_app(ctx);
-        if (rc != ESP_OK) {
-            LOG_ERR("could not open next app., error %d", rc);
-        }
+static void ble_conn_mngr_gattc_handle_reg_for_notify_ev(
+    struct ble_conn_manager_ctx* ctx,
+    struct ble_gattc_app* app,
+    esp_ble_gattc_cb_param_t* param)
+{
+    if (app->state != BLE_GATTC_APP_SUBSCRIBING) {
+        LOG_DBG("app. %d not subscribing, ignoring", app->app_id);
+        return;
+    }
+
+    if (param->reg_for_notify.status != ESP_GATT_OK) {
+        LOG_ERR("could not register for notify, status = 0x%x",
+                param->reg_for_notify.status);
+        ble_conn_mngr_gattc_abort_subscription(ctx, app);
+        return;
+    }
+
+    esp_bt_uuid_t cccd_uuid = {
+        .len = ESP_UUID_LEN_16,
+        .uuid.uuid16 = ESP_GATT_UUID_CHAR_CLIENT_CONFIG
+    };
+    esp_gattc_descr_elem_t cccd = {0};
+    uint16_t count = 1;
+
+    // The CCCD handle is cached as well, as the service discovery might not
+    // have finished if the rest of handles came from the cache.
+    if (app->hcache_hit && app->hcache.cccd_handle != 0) {
+        cccd.handle = app->hcache.cccd_handle;
     } else {
-        rc = ble_conn_mngr_gap_start_scanning(ctx);
-        if (rc != ESP_OK) {
-            LOG_ERR("could not start scannig, error %d", rc);
+        esp_gatt_status_t status = esp_ble_gattc_get_descr_by_char_handle(
+            app->gattc_if,
+            app->virt_conn_id,
+            param->reg_for_notify.handle,
+            cccd_uuid,
+            &cccd,
+            &count);
+        if (status != ESP_GATT_OK || count == 0) {
+            LOG_ERR("CCCD not found, error %d", status);
+            ble_conn_mngr_gattc_abort_subscription(ctx, app);
+            return;
+        }
+
+        if (app->hcache_valid && app->hcache.cccd_handle != cccd.handle) {
+            app->hcache.cccd_handle = cccd.handle;
+            ble_conn_mngr_hcache_store(app);
+        }
+    }
+
+    uint16_t notify_en = BLE_CCCD_NOTIFY_ENABLE;
+    esp_err_t rc = esp_ble_gattc_write_char_descr(app->gattc_if,
+                                                  app->virt_conn_id,
+                                                  cccd.handle,
+                                                  sizeof(notify_en),
+                                                  (uint8_t*)&notify_en,
+                                                  ESP_GATT_WRITE_TYPE_RSP,
+                                                  ESP_GATT_AUTH_REQ_NONE);
+    if (rc != ESP_OK) {
+        LOG_ERR("could not write CCCD, error %d", rc);
+        ble_conn_mngr_gattc_abort_subscription(ctx, app);
+    }
+}
+
+static void ble_conn_mngr_gattc_handle_write_descr_ev(
+    struct ble_conn_manager_ctx* ctx,
+    struct ble_gattc_app* app,
+    esp_ble_gattc_cb_param_t* param)
+{
+    if (app->state == BLE_GATTC_APP_SUBSCRIBING) {
+        if (param->write.status != ESP_GATT_OK) {
+            LOG_ERR("could not enable notifications, status = 0x%x",
+                    param->write.status);
+            ble_conn_mngr_gattc_abort_subscription(ctx, app);
+            return;
         }
+
+        LOG_INF("%s: subscribed", app->target_remote->name);
+        app->state = BLE_GATTC_APP_SUBSCRIBED;
+    }
+
+    if (app->gattc_profile_ev_functor != NULL) {
+        app->gattc_profile_ev_functor->handler(
+            app,
+            ESP_GATTC_WRITE_DESCR_EVT,
+            param,
+            app->gattc_profile_ev_functor->user_args);
+    }
+
+    if (app->state == BLE_GATTC_APP_SUBSCRIBED) {
+        ble_conn_mngr_gattc_yield(ctx);
     }
 }
 
@@ -361,22 +846,16 @@ static void ble_conn_mngr_gattc_handle_disconnect_ev(
             app->target_remote->found ? 1 : 0,
             param->disconnect.reason);
 
-    // It seems that the BLE stack raises this event for all apps. registered
-    // when an erroneous disconnection happens. Thus, if this remote is not
-    // found, there is nothing to disconnect, so ignore this event.
-    //
-    if (!app->target_remote->found) {
+    // The BLE stack raises this event for all apps. registered, so only
+    // handle it in the app. whose remote and connection actually dropped.
+    if (!ble_conn_mngr_app_owns_conn(app,
+                                     param->disconnect.remote_bda,
+                                     param->disconnect.conn_id)) {
         return;
     }
 
     // Handle an erroneous disconnection, that is, one not performed by this
     // device.
-    //
-    // As explained above, this event is broadcasted in case of a failed
-    // connection attempt. This means some other devices might be reachable and
-    // found, and this will indeed mark them as not found and they will be
-    // re-found when a discovery event triggers. There doesn't seem to be a way
-    // around this.
     if (param->disconnect.reason != ESP_GATT_CONN_TERMINATE_LOCAL_HOST) {
 
         LOG_ERR("device %s (virtual conn. id = %d) unreachable, reason = 0x%x",
@@ -389,32 +868,90 @@ static void ble_conn_mngr_gattc_handle_disconnect_ev(
         // unreachable), the connection will disconnect without necessarily
         // going through close, because the physical connection disconnected,
         // but the virtual connection openning couldn't be stablished. Thus,
-        // set opening and closing here as the close event handler has
+        // reset the app. state here as the close event handler has
         // potentially not being called.
-        ctx->opening = false;
-        ctx->closing = false;
+        app->state = BLE_GATTC_APP_IDLE;
+        app->virt_conn_id = VIRT_CONN_ID_CLOSED;
+        app->virt_conn_open = false;
 
         app->target_remote->found = false;
 
-        esp_err_t rc = ble_conn_mngr_gap_start_scanning(ctx);
-        if (rc != ESP_OK) {
-            LOG_ERR("could not start scannig, error %d", rc);
+        // Let the app. know its remote is lost
+        if (app->gattc_profile_ev_functor != NULL) {
+            app->gattc_profile_ev_functor->handler(
+                app,
+                ESP_GATTC_DISCONNECT_EVT,
+                param,
+                app->gattc_profile_ev_functor->user_args);
         }
+
+        // The attempt is over (see ble_gattc_app::expedited)
+        app->expedited = false;
+
+        ble_conn_mngr_gattc_yield(ctx);
     }
 }
 
-static void ble_conn_mngr_gattc_cb(esp_gattc_cb_event_t event,
-                                   esp_gatt_if_t gattc_if,
-                                   esp_ble_gattc_cb_param_t* param)
+/*
+ * Every value received satisfies the app.'s deadline, and ends its expedited
+ * attempt, if any. Keep track of the largest value received from the remote,
+ * so that the MTU exchange can be skipped when it's not needed. A failed read
+ * with cached handles might mean they are out of date, so discard them in that
+ * case.
+ *
+ */
+static void ble_conn_mngr_gattc_handle_value_ev(
+    struct ble_gattc_app* app,
+    esp_gattc_cb_event_t event,
+    esp_ble_gattc_cb_param_t* param)
 {
-    LOG_DBG("GATTC callback event %d, gattc iface. = %d", event, gattc_if);
+    esp_gatt_status_t status = ESP_GATT_OK;
+    uint16_t value_len = 0;
 
-    if (gattc_if == ESP_GATT_IF_NONE) {
-        LOG_ERR("gattc if. none");
-        return;
+    if (event == ESP_GATTC_READ_CHAR_EVT ||
+        event == ESP_GATTC_READ_MULTIPLE_EVT) {
+        status = param->read.status;
+        value_len = param->read.value_len;
+    } else {
+        value_len = param->notify.value_len;
     }
 
-    if (event == ESP_GATTC_REG_EVT && param->reg.status == ESP_GATT_OK) {
+    if (status == ESP_GATT_OK) {
+        ble_conn_mngr_sched_sample(app);
+    }
+
+    if (status != ESP_GATT_OK && app->hcache_hit) {
+        ble_conn_mngr_hcache_invalidate(app);
+    } else if (status == ESP_GATT_OK &&
+               app->hcache_valid &&
+               value_len > app->hcache.max_value_len) {
+        app->hcache.max_value_len = value_len;
+        ble_conn_mngr_hcache_store(app);
+    }
+
+    if (app->gattc_profile_ev_functor != NULL) {
+        app->gattc_profile_ev_functor->handler(
+            app, event, param, app->gattc_profile_ev_functor->user_args);
+    }
+
+    // A failed read is over too (see ble_gattc_app::expedited)
+    if (status != ESP_GATT_OK) {
+        app->expedited = false;
+    }
+}
+
+static void ble_conn_mngr_gattc_dispatch(esp_gattc_cb_event_t event,
+                                         esp_gatt_if_t gattc_if,
+                                         esp_ble_gattc_cb_param_t* param)
+{
+    LOG_DBG("GATTC callback event %d, gattc iface. = %d", event, gattc_if);
+
+    if (gattc_if == ESP_GATT_IF_NONE) {
+        LOG_ERR("gattc if. none");
+        return;
+    }
+
+    if (event == ESP_GATTC_REG_EVT && param->reg.status == ESP_GATT_OK) {
         assert(param->reg.app_id < ble_conn_mngr_ctx.apps_cnt);
         ble_conn_mngr_ctx.apps[param->reg.app_id]->app_id = param->reg.app_id;
         ble_conn_mngr_ctx.apps[param->reg.app_id]->gattc_if = gattc_if;
@@ -467,6 +1004,25 @@ static void ble_conn_mngr_gattc_cb(esp_gattc_cb_event_t event,
         break;
     }
 
+    case ESP_GATTC_READ_CHAR_EVT:
+    case ESP_GATTC_READ_MULTIPLE_EVT:
+    case ESP_GATTC_NOTIFY_EVT: {
+        ble_conn_mngr_gattc_handle_value_ev(app, event, param);
+        break;
+    }
+
+    case ESP_GATTC_REG_FOR_NOTIFY_EVT: {
+        ble_conn_mngr_gattc_handle_reg_for_notify_ev(
+            &ble_conn_mngr_ctx, app, param);
+        break;
+    }
+
+    case ESP_GATTC_WRITE_DESCR_EVT: {
+        ble_conn_mngr_gattc_handle_write_descr_ev(
+            &ble_conn_mngr_ctx, app, param);
+        break;
+    }
+
     default: {
         LOG_DBG("unhandled GATTC event %d", event);
         if (app != NULL && app->gattc_profile_ev_functor != NULL) {
@@ -486,13 +1042,19 @@ static esp_err_t ble_conn_mngr_gap_start_scanning(
         return ESP_OK;
     }
 
-    if (ctx->opening || ctx->closing) {
+    if (ctx->paused) {
+        LOG_DBG("paused, not scanning");
+        return ESP_OK;
+    }
+
+    if (!BLE_BACKGROUND_SCAN_ENABLED &&
+        ble_conn_mngr_count_busy_apps(ctx) > 0) {
         LOG_ERR(
-            "could not start scanning, busy opening or closing");
+            "could not start scanning, busy opening, closing or connected");
         return ESP_ERR_INVALID_STATE;
     }
 
-    if (ble_conn_mngr_all_remotes_found(ctx)) {
+    if (!ble_conn_mngr_scan_needed(ctx)) {
         return ESP_OK;
     }
 
@@ -574,9 +1136,35 @@ static void gap_handle_search_inq_res(struct ble_conn_manager_ctx* ctx,
         LOG_INF("found remote %s, address = " ARRAY_FMT_STR_6,
                 rem->name,
                 ARRAY_EXPAND_6(rem->remote_addr));
+
+        struct ble_gattc_app* app = ble_conn_mngr_find_profile_by_remote(
+            ctx, rem);
+        if (app != NULL && !rem->connectionless) {
+            ble_conn_mngr_hcache_load(app);
+        }
+
+        // Don't wait for the scan to finish to connect to it.
+        if (BLE_BACKGROUND_SCAN_ENABLED && !rem->connectionless) {
+            rc = ble_conn_mngr_gattc_open_next_app(ctx);
+            if (rc != ESP_OK) {
+                LOG_DBG("could not open next app., error %d", rc);
+            }
+        }
     }
 
-    if (ble_conn_mngr_all_remotes_found(ctx)) {
+    if (rem->connectionless && ctx->adv_data_functor != NULL) {
+        uint8_t len = 0;
+        uint8_t* data = esp_ble_resolve_adv_data(
+            param->scan_rst.ble_adv,
+            ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE,
+            &len);
+        if (data != NULL) {
+            ctx->adv_data_functor->handler(
+                rem, data, len, ctx->adv_data_functor->user_args);
+        }
+    }
+
+    if (!ble_conn_mngr_scan_needed(ctx)) {
         rc = ble_conn_mngr_gap_stop_scanning(ctx);
         if (rc != ESP_OK) {
             LOG_ERR("could not stop scanning, error %d", rc);
@@ -584,6 +1172,44 @@ static void gap_handle_search_inq_res(struct ble_conn_manager_ctx* ctx,
     }
 }
 
+/*
+ * Open the next app. once the scan is over. If there is none, run the GAP
+ * functor (only when no connections are in progress, as it might block) and
+ * scan again if there are still remotes to be found.
+ *
+ */
+static void ble_conn_mngr_gap_handle_scan_end(struct ble_conn_manager_ctx* ctx,
+                                              esp_gap_ble_cb_event_t event,
+                                              esp_ble_gap_cb_param_t* param)
+{
+    ctx->scanning = false;
+
+    esp_err_t rc = ble_conn_mngr_gattc_open_next_app(ctx);
+    if (rc == ESP_OK && !BLE_BACKGROUND_SCAN_ENABLED) {
+        return;
+    }
+
+    if (rc != ESP_OK && ctx->gap_ev_functor != NULL &&
+        ble_conn_mngr_count_busy_apps(ctx) == 0) {
+        LOG_DBG("could not open next app., calling GAP functor");
+
+        ctx->gap_ev_functor->handler(event,
+                                     param,
+                                     ctx->gap_ev_functor->user_args);
+    }
+
+    if (!ble_conn_mngr_scan_needed(ctx)) {
+        return;
+    }
+
+    LOG_DBG("not all remotes found, retrying scan");
+
+    rc = ble_conn_mngr_gap_start_scanning(ctx);
+    if (rc != ESP_OK) {
+        LOG_ERR("error trying to start scanning");
+    }
+}
+
 static void ble_conn_mngr_gap_handle_scan_result_ev(
     esp_ble_gap_cb_param_t* param)
 {
@@ -594,68 +1220,22 @@ static void ble_conn_mngr_gap_handle_scan_result_ev(
 
     if (param->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_CMPL_EVT) {
         LOG_INF("search inq. completed");
-        ble_conn_mngr_ctx.scanning = false;
-
-        esp_err_t rc = ble_conn_mngr_gattc_open_next_app(&ble_conn_mngr_ctx);
-        if (rc != ESP_OK) {
-            if (ble_conn_mngr_ctx.gap_ev_functor != NULL) {
-                LOG_DBG("could not open next app., calling GAP functor");
-
-                ble_conn_mngr_ctx.gap_ev_functor->handler(
-                    ESP_GAP_BLE_SCAN_RESULT_EVT,
-                    param,
-                    ble_conn_mngr_ctx.gap_ev_functor->user_args
-                );
-            }
-
-            LOG_DBG(
-                "could not open any connection after scanning, retrying scan");
-
-            if (ble_conn_mngr_all_remotes_found(&ble_conn_mngr_ctx)) {
-                return;
-            }
-
-            rc = ble_conn_mngr_gap_start_scanning(&ble_conn_mngr_ctx);
-            if (rc != ESP_OK) {
-                LOG_ERR("error trying to start scanning");
-            }
-        }
+        ble_conn_mngr_gap_handle_scan_end(&ble_conn_mngr_ctx,
+                                          ESP_GAP_BLE_SCAN_RESULT_EVT,
+                                          param);
     }
 }
 
 static void ble_conn_mngr_gap_handle_scan_stop_ev(esp_ble_gap_cb_param_t* param)
 {
     LOG_INF("scan stopped, status = %x", param->scan_stop_cmpl.status);
-    ble_conn_mngr_ctx.scanning = false;
-
-    esp_err_t rc = ble_conn_mngr_gattc_open_next_app(&ble_conn_mngr_ctx);
-    if (rc != ESP_OK) {
-        if (ble_conn_mngr_ctx.gap_ev_functor != NULL) {
-            LOG_DBG("could not open next app., calling GAP functor");
-
-            ble_conn_mngr_ctx.gap_ev_functor->handler(
-                ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT,
-                param,
-                ble_conn_mngr_ctx.gap_ev_functor->user_args
-            );
-        }
-
-        LOG_DBG(
-            "could not open any connection after scanning, retrying scan");
-
-        if (ble_conn_mngr_all_remotes_found(&ble_conn_mngr_ctx)) {
-            return;
-        }
-
-        rc = ble_conn_mngr_gap_start_scanning(&ble_conn_mngr_ctx);
-        if (rc != ESP_OK) {
-            LOG_ERR("error trying to start scanning");
-        }
-    }
+    ble_conn_mngr_gap_handle_scan_end(&ble_conn_mngr_ctx,
+                                      ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT,
+                                      param);
 }
 
-static void ble_conn_mngr_esp_gap_cb(esp_gap_ble_cb_event_t event,
-                                     esp_ble_gap_cb_param_t* param)
+static void ble_conn_mngr_gap_dispatch(esp_gap_ble_cb_event_t event,
+                                       esp_ble_gap_cb_param_t* param)
 {
     switch (event) {
     case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
@@ -684,16 +1264,443 @@ static void ble_conn_mngr_esp_gap_cb(esp_gap_ble_cb_event_t event,
     }
 }
 
+static void ble_conn_mngr_event_account(struct ble_conn_manager_ctx* ctx,
+                                       int64_t start_us)
+{
+    uint32_t residency_us = (uint32_t)(esp_timer_get_time() - start_us);
+
+    ctx->event_stats.events++;
+    if (residency_us > ctx->event_stats.max_cb_residency_us) {
+        ctx->event_stats.max_cb_residency_us = residency_us;
+    }
+}
+
+static struct ble_conn_mngr_event* ble_conn_mngr_event_reserve(
+    struct ble_conn_manager_ctx* ctx,
+    enum ble_conn_mngr_event_class ev_class)
+{
+    struct ble_conn_manager_event_stats* st = &ctx->event_stats;
+    size_t free_slots = BLE_EVENT_RING_SIZE - spsc_ring_count(&ctx->event_ring);
+
+    switch (ev_class) {
+    case BLE_EVENT_CLASS_SCAN_RESULT:
+        if (free_slots >
+            BLE_EVENT_RING_RESERVED + BLE_EVENT_RING_NOTIFY_SLOTS) {
+            return spsc_ring_reserve(&ctx->event_ring);
+        }
+        st->dropped_scan_results++;
+        return NULL;
+
+    case BLE_EVENT_CLASS_NOTIFY:
+        if (free_slots > BLE_EVENT_RING_RESERVED) {
+            return spsc_ring_reserve(&ctx->event_ring);
+        }
+        st->dropped_notifications++;
+        return NULL;
+
+    default:
+        break;
+    }
+
+    // Never wait for a slot here, it would hold the BT host task. The event
+    // task recovers from the drop instead.
+    struct ble_conn_mngr_event* ev = spsc_ring_reserve(&ctx->event_ring);
+    if (ev == NULL) {
+        st->dropped_lifecycle++;
+        atomic_store(&ctx->event_ring_overflowed, true);
+        xTaskNotify(ctx->event_task, BLE_EVENT_TASK_EVENTS, eSetBits);
+    }
+
+    return ev;
+}
+
+static void ble_conn_mngr_event_commit(struct ble_conn_manager_ctx* ctx)
+{
+    spsc_ring_commit(&ctx->event_ring);
+
+    uint32_t pending = spsc_ring_count(&ctx->event_ring);
+    if (pending > ctx->event_stats.max_pending) {
+        ctx->event_stats.max_pending = pending;
+    }
+
+    xTaskNotify(ctx->event_task, BLE_EVENT_TASK_EVENTS, eSetBits);
+}
+
+static void ble_conn_mngr_event_copy_value(struct ble_conn_mngr_event* ev,
+                                           uint8_t** value,
+                                           uint16_t* value_len)
+{
+    if (*value == NULL) {
+        return;
+    }
+
+    if (*value_len > sizeof(ev->value)) {
+        LOG_ERR("value too long (%d), truncating", *value_len);
+        *value_len = sizeof(ev->value);
+    }
+
+    memcpy(ev->value, *value, *value_len);
+    *value = ev->value;
+}
+
+static void ble_conn_mngr_gattc_cb(esp_gattc_cb_event_t event,
+                                   esp_gatt_if_t gattc_if,
+                                   esp_ble_gattc_cb_param_t* param)
+{
+    int64_t start_us = esp_timer_get_time();
+
+    if (!BLE_EVENT_TASK_ENABLED) {
+        ble_conn_mngr_gattc_dispatch(event, gattc_if, param);
+        ble_conn_mngr_event_account(&ble_conn_mngr_ctx, start_us);
+        return;
+    }
+
+    enum ble_conn_mngr_event_class ev_class = event == ESP_GATTC_NOTIFY_EVT
+                                                  ? BLE_EVENT_CLASS_NOTIFY
+                                                  : BLE_EVENT_CLASS_LIFECYCLE;
+
+    struct ble_conn_mngr_event* ev = ble_conn_mngr_event_reserve(
+        &ble_conn_mngr_ctx, ev_class);
+    if (ev != NULL) {
+        ev->type = BLE_CONN_MNGR_EVENT_GATTC;
+        ev->gattc.event = event;
+        ev->gattc.gattc_if = gattc_if;
+        ev->gattc.param = *param;
+
+        switch (event) {
+        case ESP_GATTC_READ_CHAR_EVT:
+        case ESP_GATTC_READ_DESCR_EVT:
+        case ESP_GATTC_READ_MULTIPLE_EVT:
+            ble_conn_mngr_event_copy_value(ev,
+                                           &ev->gattc.param.read.value,
+                                           &ev->gattc.param.read.value_len);
+            break;
+
+        case ESP_GATTC_NOTIFY_EVT:
+            ble_conn_mngr_event_copy_value(ev,
+                                           &ev->gattc.param.notify.value,
+                                           &ev->gattc.param.notify.value_len);
+            break;
+
+        default:
+            break;
+        }
+
+        ble_conn_mngr_event_commit(&ble_conn_mngr_ctx);
+    }
+
+    ble_conn_mngr_event_account(&ble_conn_mngr_ctx, start_us);
+}
+
+static void ble_conn_mngr_esp_gap_cb(esp_gap_ble_cb_event_t event,
+                                     esp_ble_gap_cb_param_t* param)
+{
+    int64_t start_us = esp_timer_get_time();
+
+    if (!BLE_EVENT_TASK_ENABLED) {
+        ble_conn_mngr_gap_dispatch(event, param);
+        ble_conn_mngr_event_account(&ble_conn_mngr_ctx, start_us);
+        return;
+    }
+
+    bool scan_result = event == ESP_GAP_BLE_SCAN_RESULT_EVT &&
+                       param->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_RES_EVT;
+
+    struct ble_conn_mngr_event* ev = ble_conn_mngr_event_reserve(
+        &ble_conn_mngr_ctx,
+        scan_result ? BLE_EVENT_CLASS_SCAN_RESULT : BLE_EVENT_CLASS_LIFECYCLE);
+    if (ev != NULL) {
+        ev->type = BLE_CONN_MNGR_EVENT_GAP;
+        ev->gap.event = event;
+        ev->gap.param = *param;
+        ble_conn_mngr_event_commit(&ble_conn_mngr_ctx);
+    }
+
+    ble_conn_mngr_event_account(&ble_conn_mngr_ctx, start_us);
+}
+
+/*
+ * Go on with the apps. and the scans held by the pause.
+ *
+ */
+static void ble_conn_mngr_handle_resume(struct ble_conn_manager_ctx* ctx)
+{
+    if (!ctx->paused) {
+        return;
+    }
+
+    LOG_DBG("resuming");
+    ctx->paused = false;
+
+    ble_conn_mngr_gattc_yield(ctx);
+
+    // A scan that ended during the pause was not restarted.
+    if (!ctx->scanning && ble_conn_mngr_count_busy_apps(ctx) == 0) {
+        esp_err_t rc = ble_conn_mngr_gap_start_scanning(ctx);
+        if (rc != ESP_OK) {
+            LOG_ERR("could not start scannig, error %d", rc);
+        }
+    }
+}
+
+/*
+ * A lifecycle event was dropped, so the apps.' states can't be trusted: an
+ * app. might wait for an open or a close that will never be notified. Close
+ * the apps. with a connection open (their close event brings them back to
+ * idle), drop the link of the rest, which are set back to idle right away,
+ * end the scan, and start over.
+ *
+ */
+static void ble_conn_mngr_resync(struct ble_conn_manager_ctx* ctx)
+{
+    LOG_ERR("event ring overflowed, resynchronizing the apps.");
+    ctx->event_stats.resyncs++;
+
+    for (size_t i = 0; i < ctx->apps_cnt; i++) {
+        struct ble_gattc_app* app = ctx->apps[i];
+
+        if (app->state == BLE_GATTC_APP_IDLE) {
+            continue;
+        }
+
+        LOG_WRN("%s: resetting app. %d in state %d",
+                app->target_remote->name,
+                app->app_id,
+                app->state);
+
+        if (app->virt_conn_open &&
+            esp_ble_gattc_close(app->gattc_if, app->virt_conn_id) == ESP_OK) {
+            app->state = BLE_GATTC_APP_CLOSING;
+            continue;
+        }
+
+        esp_ble_gap_disconnect(app->target_remote->remote_addr);
+
+        app->state = BLE_GATTC_APP_IDLE;
+        app->virt_conn_id = VIRT_CONN_ID_CLOSED;
+        app->virt_conn_open = false;
+        app->expedited = false;
+    }
+
+    if (ctx->scanning) {
+        esp_ble_gap_stop_scanning();
+        ctx->scanning = false;
+    }
+
+    ble_conn_mngr_gattc_yield(ctx);
+}
+
+static void ble_conn_mngr_resume_timer_cb(TimerHandle_t timer)
+{
+    ble_conn_mngr_resume();
+}
+
+/*
+ * Run the event loop: dispatch the events queued by the BLE stack callbacks,
+ * in order. The end of a pause is handled first, as the events might pause
+ * again. After an overflow, the apps. are resynchronized once the ring is
+ * drained.
+ *
+ */
+static void ble_conn_mngr_event_task(void* args)
+{
+    struct ble_conn_manager_ctx* ctx = (struct ble_conn_manager_ctx*)args;
+
+    for (;;) {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+
+        if (bits & BLE_EVENT_TASK_RESUME) {
+            ble_conn_mngr_handle_resume(ctx);
+        }
+
+        if (bits & BLE_EVENT_TASK_SCHEDULE) {
+            ble_conn_mngr_gattc_yield(ctx);
+        }
+
+        struct ble_conn_mngr_event* ev = NULL;
+        while ((ev = spsc_ring_peek(&ctx->event_ring)) != NULL) {
+            if (ev->type == BLE_CONN_MNGR_EVENT_GATTC) {
+                ble_conn_mngr_gattc_dispatch(ev->gattc.event,
+                                             ev->gattc.gattc_if,
+                                             &ev->gattc.param);
+            } else {
+                ble_conn_mngr_gap_dispatch(ev->gap.event, &ev->gap.param);
+            }
+
+            spsc_ring_release(&ctx->event_ring);
+        }
+
+        if (atomic_exchange(&ctx->event_ring_overflowed, false)) {
+            ble_conn_mngr_resync(ctx);
+        }
+    }
+}
+
 esp_err_t ble_conn_mngr_close(struct ble_gattc_app* app)
 {
     return ble_conn_mngr_gattc_close(&ble_conn_mngr_ctx, app);
 }
 
+esp_err_t ble_conn_mngr_read(struct ble_gattc_app* app)
+{
+    struct ble_gattc_service* srv = &app->target_service;
+
+    if (srv->target_chars_cnt == 1) {
+        return esp_ble_gattc_read_char(app->gattc_if,
+                                       app->virt_conn_id,
+                                       srv->target_chars[0].handle,
+                                       ESP_GATT_AUTH_REQ_NONE);
+    }
+
+    esp_gattc_multi_t read_multi = {
+        .num_attr = srv->target_chars_cnt
+    };
+    for (size_t i = 0; i < srv->target_chars_cnt; i++) {
+        read_multi.handles[i] = srv->target_chars[i].handle;
+    }
+
+    return esp_ble_gattc_read_multiple(app->gattc_if,
+                                       app->virt_conn_id,
+                                       &read_multi,
+                                       ESP_GATT_AUTH_REQ_NONE);
+}
+
+esp_err_t ble_conn_mngr_subscribe(struct ble_gattc_app* app)
+{
+    return ble_conn_mngr_gattc_subscribe(&ble_conn_mngr_ctx, app);
+}
+
+void ble_conn_mngr_expedite(const struct ble_remote_dev* remote)
+{
+    struct ble_conn_manager_ctx* ctx = &ble_conn_mngr_ctx;
+
+    for (size_t i = 0; i < ctx->apps_cnt; i++) {
+        if (ctx->apps[i]->target_remote == remote) {
+            ctx->apps[i]->expedited = true;
+        }
+    }
+
+    // Wake the event loop up, in case it's paused. Without the event task,
+    // only a timed pause is cut short (see ble_conn_mngr_pause), and the
+    // token is only given while it lasts, so that it doesn't end the next
+    // one right away.
+    if (BLE_EVENT_TASK_ENABLED) {
+        xTaskNotify(ctx->event_task, BLE_EVENT_TASK_SCHEDULE, eSetBits);
+    } else if (ctx->paused && !ctx->pause_until_resumed) {
+        xSemaphoreGive(ctx->pause_sem);
+    }
+}
+
+void ble_conn_mngr_pause(uint32_t ms)
+{
+    struct ble_conn_manager_ctx* ctx = &ble_conn_mngr_ctx;
+
+    TickType_t ticks = ms == BLE_CONN_MNGR_UNTIL_RESUMED ? portMAX_DELAY
+                                                         : pdMS_TO_TICKS(ms);
+    if (ticks == 0) {
+        return;
+    }
+
+    if (!BLE_EVENT_TASK_ENABLED) {
+        // Nothing else runs in the meantime anyway. The end of a serving
+        // window can be signaled before its pause starts, so the token is
+        // kept for a pause until resumed; a timed pause drops any token left
+        // by an expedite or a resume that found nothing paused instead.
+        if (ms != BLE_CONN_MNGR_UNTIL_RESUMED) {
+            xSemaphoreTake(ctx->pause_sem, 0);
+        }
+
+        ctx->pause_until_resumed = ms == BLE_CONN_MNGR_UNTIL_RESUMED;
+        ctx->paused = true;
+        xSemaphoreTake(ctx->pause_sem, ticks);
+        ctx->paused = false;
+        return;
+    }
+
+    if (ctx->paused) {
+        LOG_ERR("already paused");
+        return;
+    }
+
+    LOG_DBG("pausing for %lu ms", ms);
+    ctx->paused = true;
+
+    if (ms != BLE_CONN_MNGR_UNTIL_RESUMED &&
+        xTimerChangePeriod(ctx->resume_timer, ticks, 0) != pdPASS) {
+        LOG_ERR("could not start the resume timer");
+        ctx->paused = false;
+    }
+}
+
+void ble_conn_mngr_resume(void)
+{
+    struct ble_conn_manager_ctx* ctx = &ble_conn_mngr_ctx;
+
+    // Without the event task, the token is given even if the pause hasn't
+    // started yet (the window ended first); it's dropped by the next timed
+    // pause otherwise (see ble_conn_mngr_pause).
+    if (BLE_EVENT_TASK_ENABLED) {
+        xTaskNotify(ctx->event_task, BLE_EVENT_TASK_RESUME, eSetBits);
+    } else {
+        xSemaphoreGive(ctx->pause_sem);
+    }
+}
+
+bool ble_conn_mngr_paused(void)
+{
+    return ble_conn_mngr_ctx.paused;
+}
+
+size_t ble_conn_mngr_missing_remotes(void)
+{
+    return ble_conn_mngr_count_missing_remotes(&ble_conn_mngr_ctx);
+}
+
+void ble_conn_mngr_log_stats(void)
+{
+    struct ble_conn_manager_event_stats* ev_st = &ble_conn_mngr_ctx.event_stats;
+
+    LOG_INF("%lu BLE events, max. %lu pending, max. callback residency %lu us",
+            ev_st->events,
+            ev_st->max_pending,
+            ev_st->max_cb_residency_us);
+    LOG_INF("dropped: %lu scan results, %lu notifications, %lu lifecycle "
+            "events (%lu resyncs)",
+            ev_st->dropped_scan_results,
+            ev_st->dropped_notifications,
+            ev_st->dropped_lifecycle,
+            ev_st->resyncs);
+
+    for (size_t i = 0; i < ble_conn_mngr_ctx.apps_cnt; i++) {
+        struct ble_gattc_app* app = ble_conn_mngr_ctx.apps[i];
+        struct ble_gattc_app_stats* st = &app->stats;
+
+        LOG_INF("%s: %lu conns., %lu samples, period %lu ms, "
+                "%lu missed deadlines (max. %lu ms, avg. %lu ms late)",
+                app->target_remote->name,
+                st->connections,
+                st->samples,
+                app->period_ms,
+                st->missed_deadlines,
+                st->max_lateness_ms,
+                st->missed_deadlines == 0
+                    ? 0
+                    : st->total_lateness_ms / st->missed_deadlines);
+    }
+}
+
 void ble_conn_mngr_set_gap_ev_functor(struct gap_ev_functor* gap_ev_functor)
 {
     ble_conn_mngr_ctx.gap_ev_functor = gap_ev_functor;
 }
 
+void ble_conn_mngr_set_adv_data_functor(
+    struct adv_data_functor* adv_data_functor)
+{
+    ble_conn_mngr_ctx.adv_data_functor = adv_data_functor;
+}
+
 void ble_conn_mngr_start(struct ble_gattc_app* apps[], size_t cnt)
 {
     esp_err_t ret = nvs_flash_init();
@@ -725,6 +1732,35 @@ void ble_conn_mngr_start(struct ble_gattc_app* apps[], size_t cnt)
     ret = esp_bluedroid_enable();
     ERR_CHECK(ret);
 
+    ble_conn_mngr_ctx.pause_sem = xSemaphoreCreateBinaryStatic(
+        &ble_conn_mngr_ctx.pause_sem_buf);
+
+    if (BLE_EVENT_TASK_ENABLED) {
+        ble_conn_mngr_ctx.resume_timer = xTimerCreateStatic(
+            "ble_resume",
+            1,
+            pdFALSE,
+            &ble_conn_mngr_ctx,
+            ble_conn_mngr_resume_timer_cb,
+            &ble_conn_mngr_ctx.resume_timer_buf);
+
+        spsc_ring_init(&ble_conn_mngr_ctx.event_ring,
+                       ble_conn_mngr_events,
+                       sizeof(*ble_conn_mngr_events),
+                       BLE_EVENT_RING_SIZE);
+
+        BaseType_t task_rc = xTaskCreate(ble_conn_mngr_event_task,
+                                         "ble_conn_mngr",
+                                         BLE_EVENT_TASK_STACK_SIZE,
+                                         &ble_conn_mngr_ctx,
+                                         BLE_EVENT_TASK_PRIORITY,
+                                         &ble_conn_mngr_ctx.event_task);
+        if (task_rc != pdPASS) {
+            LOG_ERR("could not create the event task");
+            return;
+        }
+    }
+
     ret = esp_ble_gap_register_callback(ble_conn_mngr_esp_gap_cb);
     ERR_CHECK(ret);
 
@@ -734,6 +1770,11 @@ void ble_conn_mngr_start(struct ble_gattc_app* apps[], size_t cnt)
     ret = esp_ble_gap_set_scan_params(&ble_conn_mngr_ctx.ble_scan_params);
     ERR_CHECK(ret);
 
+    // The local MTU applies to all the connections, so set it only once. It's
+    // only exchanged with the remotes that need it.
+    ret = esp_ble_gatt_set_local_mtu(BLE_MTU);
+    ERR_CHECK(ret);
+
     ble_conn_mngr_ctx.apps = apps;
     ble_conn_mngr_ctx.apps_cnt = cnt;
     ble_conn_mngr_ctx.curr_prf_idx = 0;
@@ -10,19 +10,51 @@
 #ifndef BLE_CONN_MANAGER_H
 #define BLE_CONN_MANAGER_H
 
+#include "freertos/FreeRTOS.h"
+
 #include "esp_bt.h"
 #include "esp_gap_ble_api.h"
 #include "esp_gattc_api.h"
 #include "esp_gatt_defs.h"
 
+#include "ble_handle_cache.h"
+
 #define DEV_NAME_MAX_LEN 32
 #define VIRT_CONN_ID_CLOSED 0xdead
 
+// Max. number of chars. of a GATTC profile, all read at once.
+#define BLE_GATTC_MAX_CHARS BLE_HANDLE_CACHE_MAX_CHARS
+
+#define BLE_GATTC_CHAR(char_uuid)                                               \
+    {                                                                           \
+        .uuid.len = ESP_UUID_LEN_16,                                            \
+        .uuid.uuid = {char_uuid},                                               \
+        .handle = 0                                                             \
+    }
+
 #define BLE_CON_MNGR_GATTC_PROFILE_DEFINE(var_name,                             \
                                           target_remote_ptr,                    \
                                           target_srv_uuid,                      \
                                           target_char_uuid,                     \
                                           gattc_gattc_profile_ev_functor)       \
+    BLE_CON_MNGR_GATTC_MULTI_CHAR_PROFILE_DEFINE(                               \
+        var_name,                                                               \
+        target_remote_ptr,                                                      \
+        target_srv_uuid,                                                        \
+        gattc_gattc_profile_ev_functor,                                         \
+        BLE_GATTC_CHAR(target_char_uuid))
+
+/*
+ * The chars. are given as a list of BLE_GATTC_CHAR(uuid), up to
+ * BLE_GATTC_MAX_CHARS.
+ *
+ */
+#define BLE_CON_MNGR_GATTC_MULTI_CHAR_PROFILE_DEFINE(                           \
+    var_name,                                                                   \
+    target_remote_ptr,                                                          \
+    target_srv_uuid,                                                            \
+    gattc_gattc_profile_ev_functor,                                             \
+    ...)                                                                        \
                                                                                 \
     struct ble_gattc_app var_name = {                                           \
         .target_remote = target_remote_ptr,                                     \
@@ -30,6 +62,13 @@
         .virt_conn_id = VIRT_CONN_ID_CLOSED,                                    \
         .gattc_if = ESP_GATT_IF_NONE,                                           \
         .virt_conn_open = false,                                                \
+        .state = BLE_GATTC_APP_IDLE,                                            \
+        .priority = BLE_GATTC_APP_PRIO_NORMAL,                                  \
+        .period_ms = 0,                                                         \
+        .deadline = 0,                                                          \
+        .deadline_valid = false,                                                \
+        .hcache_valid = false,                                                  \
+        .hcache_hit = false,                                                    \
         .gattc_profile_ev_functor = gattc_gattc_profile_ev_functor,             \
         .target_service = {                                                     \
             .uuid = {                                                           \
@@ -43,14 +82,15 @@
             .found = false,                                                     \
             .start_handle = 0,                                                  \
             .end_handle = 0,                                                    \
-            .target_char = {                                                    \
-                .uuid.len = ESP_UUID_LEN_16,                                    \
-                .uuid.uuid = {target_char_uuid},                                \
-            }                                                                   \
+            .target_chars = {__VA_ARGS__},                                      \
+            .target_chars_cnt =                                                 \
+                sizeof((struct ble_gattc_char[]){__VA_ARGS__}) /                \
+                sizeof(struct ble_gattc_char),                                  \
         },                                                                      \
     }
 
 struct ble_gattc_app;
+struct ble_remote_dev;
 
 /**
  * @brief GATTC profile event handler.
@@ -69,6 +109,16 @@ typedef void (*gap_ev_handler_t)(esp_gap_ble_cb_event_t event,
                                  esp_ble_gap_cb_param_t* param,
                                  void* user_args);
 
+/**
+ * @brief Advertising data handler. Executed with the manufacturer specific
+ * data advertised by a connectionless remote.
+ *
+ */
+typedef void (*adv_data_handler_t)(struct ble_remote_dev* remote,
+                                   const uint8_t* data,
+                                   uint8_t len,
+                                   void* user_args);
+
 /**
  * @brief GATTC profile event functor.
  */
@@ -87,9 +137,21 @@ struct gap_ev_functor
     void* user_args;
 };
 
+/**
+ * @brief Advertising data functor.
+ */
+struct adv_data_functor
+{
+    adv_data_handler_t handler;
+    void* user_args;
+};
+
 /**
  * @brief GATTC profile target remote device.
  *
+ * A connectionless remote is never connected to; instead, its data is taken
+ * from its advertisements, so the remote is just scanned for.
+ *
  */
 struct ble_remote_dev
 {
@@ -97,6 +159,7 @@ struct ble_remote_dev
     esp_bd_addr_t remote_addr;
     esp_ble_addr_type_t addr_type;
     bool found;
+    bool connectionless;
 };
 
 /**
@@ -110,7 +173,9 @@ struct ble_gattc_char
 };
 
 /**
- * @brief GATTC service.
+ * @brief GATTC service. Its target chars. are read all at once, so their
+ * values must have a fixed length (but the last one's). Only the first one can
+ * be subscribed to.
  *
  */
 struct ble_gattc_service
@@ -119,7 +184,58 @@ struct ble_gattc_service
     bool found;
     uint16_t start_handle;
     uint16_t end_handle;
-    struct ble_gattc_char target_char;
+    struct ble_gattc_char target_chars[BLE_GATTC_MAX_CHARS];
+    size_t target_chars_cnt;
+};
+
+/**
+ * @brief GATTC application connection state. Each app. tracks its own
+ * connection, so that several of them can be in progress at the same time.
+ *
+ * A subscribed app. keeps its connection open to receive notifications, but
+ * it's not in progress anymore, i.e. it doesn't hold the event loop.
+ *
+ */
+enum ble_gattc_app_state
+{
+    BLE_GATTC_APP_IDLE,
+    BLE_GATTC_APP_OPENING,
+    BLE_GATTC_APP_OPEN,
+    BLE_GATTC_APP_SUBSCRIBING,
+    BLE_GATTC_APP_SUBSCRIBED,
+    BLE_GATTC_APP_CLOSING
+};
+
+/**
+ * @brief GATTC application priority. A high priority app. that is due is
+ * opened before any normal one, whatever their deadlines.
+ *
+ */
+enum ble_gattc_app_priority
+{
+    BLE_GATTC_APP_PRIO_NORMAL,
+    BLE_GATTC_APP_PRIO_HIGH
+};
+
+/**
+ * @brief GATTC application connection statistics. The handle cache allows
+ * skipping the MTU exchange of a connection, one round trip saved each. (It
+ * lets the service search be skipped too, but that's a lookup in the stack's
+ * local attribute table, as BT_GATTC_CACHE_NVS_FLASH already avoids the
+ * rediscovery over the air, so it's not counted.)
+ *
+ * Every char. value received is a sample. A sample received after the app.'s
+ * deadline counts as a missed deadline, late by the time elapsed since it.
+ *
+ */
+struct ble_gattc_app_stats
+{
+    uint32_t connections;
+    uint32_t saved_mtu_exchanges;
+    uint32_t samples;
+    uint32_t missed_deadlines;
+    uint32_t max_lateness_ms;
+    uint32_t total_lateness_ms;
 };
 
 /**
@@ -133,6 +249,20 @@ struct ble_gattc_app
     esp_gatt_if_t gattc_if;
     uint16_t virt_conn_id;
     bool virt_conn_open;
+    enum ble_gattc_app_state state;
+    enum ble_gattc_app_priority priority;
+    uint32_t period_ms;
+    TickType_t deadline;
+    bool deadline_valid;
+    // Set by ble_conn_mngr_expedite, cleared once the attempt is over: when a
+    // value is received, or after the app.'s handler for a failed open or
+    // read, a close or a disconnection, which thus tells a failed expedited
+    // attempt by it still being set.
+    volatile bool expedited;
+    struct ble_handle_cache_entry hcache;
+    bool hcache_valid;
+    bool hcache_hit;
+    struct ble_gattc_app_stats stats;
     struct ble_gattc_service target_service;
     struct gattc_gattc_profile_ev_functor* gattc_profile_ev_functor;
     struct gap_ev_functor* gap_ev_functor;
@@ -144,16 +274,38 @@ struct ble_gattc_app
  * tasks and executing the app's callback when:
  *
  *  - On event ESP_GATTC_SEARCH_CMPL_EVT
- *  - On event ESP_GATTC_READ_CHAR_EVT
+ *  - On event ESP_GATTC_READ_CHAR_EVT (profiles with a single char.)
+ *  - On event ESP_GATTC_READ_MULTIPLE_EVT (profiles with several chars.)
  *
  * All the data required by the callback to perform any BLE operation will be
  * in the parameters provided to it.
  *
+ * If the remote's handles are in the handle cache, ESP_GATTC_SEARCH_CMPL_EVT
+ * is raised right after the connection is open, with the target char. handles
+ * already resolved (and the parameters of ESP_GATTC_OPEN_EVT).
+ *
  * This event loop is collaborative, so the app.'s callback is in charge to
  * disconnect (and so yield the event loop to the next app.).
  *
+ * Up to CONFIG_BLE_CONN_MNGR_MAX_CONNECTIONS apps. are kept connected at the
+ * same time. Connections are opened one at a time, but once open they progress
+ * (MTU exchange, discovery, reads) concurrently.
+ *
+ * Apps. are scheduled earliest deadline first: an app. must receive its char.
+ * value within period_ms of the previous one, and the found app. whose
+ * deadline is nearest is opened next. Apps. never serviced are due already,
+ * and apps. with a period of 0 have no deadline, so they are only opened
+ * when no other app. is available. The scheduler is work conserving: an app.
+ * can be opened before its deadline if it's the nearest one. High priority
+ * apps. that are due, and expedited apps. (see @ref ble_conn_mngr_expedite),
+ * preempt the rest.
+ *
  * This function will keep scanning devices until all the required ones by
- * @param{apps} are found, in which case the can will stop.
+ * @param{apps} are found, in which case the can will stop. If any of them is
+ * connectionless, scanning goes on (see
+ * @ref ble_conn_mngr_set_adv_data_functor). With
+ * CONFIG_BLE_CONN_MNGR_BACKGROUND_SCAN, the scan runs with a low duty cycle
+ * alongside the connections, and remotes are opened as soon as they are found.
  *
  * @param apps List of GATTC apps to be scheduled
  * @param cnt Number of elements in @param{apps}
@@ -162,20 +314,112 @@ struct ble_gattc_app
 void ble_conn_mngr_start(struct ble_gattc_app* apps[], size_t cnt);
 
 /**
- * @brief Disconnect the given GATTC app.
+ * @brief Disconnect the given GATTC app. Subscribed apps. can be disconnected
+ * as well.
  *
  * @param app GATTC app. to be disconnected.
  *
  */
 esp_err_t ble_conn_mngr_close(struct ble_gattc_app* app);
 
+/**
+ * @brief Read the target chars. of the given GATTC app. in a single ATT round
+ * trip: a read request if it has only one char., or a read multiple request
+ * otherwise. Once done, the app.'s callback is executed on
+ * ESP_GATTC_READ_CHAR_EVT or ESP_GATTC_READ_MULTIPLE_EVT respectively, with
+ * the values of all the chars. in order.
+ *
+ * @param app GATTC app. to be read. Its target chars. must have been found
+ * (i.e. after ESP_GATTC_SEARCH_CMPL_EVT).
+ *
+ */
+esp_err_t ble_conn_mngr_read(struct ble_gattc_app* app);
+
+/**
+ * @brief Subscribe to notifications of the first target char. of the given GATTC
+ * app. This registers for notifications and writes the char. CCCD. Once done,
+ * the app.'s callback is executed on ESP_GATTC_WRITE_DESCR_EVT and the
+ * connection is kept open, yielding the event loop to the next app. From then
+ * on, the callback is executed on every ESP_GATTC_NOTIFY_EVT.
+ *
+ * At least one connection is always kept available for the apps. that are not
+ * subscribed, so this will fail with ESP_ERR_NO_MEM if that's not possible,
+ * and with ESP_ERR_NOT_SUPPORTED if CONFIG_BLE_CONN_MNGR_MAX_CONNECTIONS is 1;
+ * the app. can then keep reading its char. as usual.
+ *
+ * @param app GATTC app. to be subscribed. It must be connected and its target
+ * char. must have been found (i.e. after ESP_GATTC_SEARCH_CMPL_EVT).
+ *
+ */
+esp_err_t ble_conn_mngr_subscribe(struct ble_gattc_app* app);
+
+/**
+ * @brief Thread-safe. Open the apps. of @p remote next, ahead of any deadline,
+ * e.g. because a client is waiting for a fresh value. Expediting an app.
+ * several times before it receives a value results in a single read.
+ *
+ */
+void ble_conn_mngr_expedite(const struct ble_remote_dev* remote);
+
+// Pause until @ref ble_conn_mngr_resume is called rather than for a time.
+#define BLE_CONN_MNGR_UNTIL_RESUMED UINT32_MAX
+
+/**
+ * @brief Pause the scans and the opening of apps. for @p ms (or until
+ * resumed, with BLE_CONN_MNGR_UNTIL_RESUMED), e.g. to leave the radio to the
+ * UDP server. Expedited and due high priority apps. are still opened. To be
+ * called from the GATTC and GAP functors, while not paused.
+ *
+ * With CONFIG_BLE_CONN_MNGR_EVENT_TASK, it returns right away and the event
+ * loop goes on with the connections in progress. Otherwise, it blocks the BT
+ * host task until the pause is over, or an app. is expedited during a timed
+ * pause.
+ *
+ */
+void ble_conn_mngr_pause(uint32_t ms);
+
+/**
+ * @brief Thread-safe. End the pause started by @ref ble_conn_mngr_pause.
+ *
+ */
+void ble_conn_mngr_resume(void);
+
+/**
+ * @brief Whether the scans and the opening of apps. are paused. To be called
+ * from the GATTC and GAP functors.
+ *
+ */
+bool ble_conn_mngr_paused(void);
+
+/**
+ * @brief Number of (connectable) remotes not found yet by the scans.
+ *
+ */
+size_t ble_conn_mngr_missing_remotes(void);
+
+/**
+ * @brief Log the connection and scheduling statistics of all the apps.
+ *
+ */
+void ble_conn_mngr_log_stats(void);
+
 /**
  * @brief Set a GAP event handler.
  *
  * @param gap_ev_functor Function to be executed upon certain GAP events:
  *      - When scan stops and there are no GATTC profiles
- *        ready to run.
+ *        ready to run (with background scanning, only if no connections
+ *        are in progress either).
  */
 void ble_conn_mngr_set_gap_ev_functor(struct gap_ev_functor* gap_ev_functor);
 
+/**
+ * @brief Set the advertising data handler.
+ *
+ * @param adv_data_functor Function to be executed every time a connectionless
+ * remote is scanned, with its manufacturer specific data.
+ */
+void ble_conn_mngr_set_adv_data_functor(
+    struct adv_data_functor* adv_data_functor);
+
 #endif /* CONN_MANAGER_H */
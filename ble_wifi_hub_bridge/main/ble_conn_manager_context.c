@@ -4,6 +4,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "esp_bt.h"
 #include "esp_gap_ble_api.h"
 #include "esp_gattc_api.h"
@@ -17,16 +20,62 @@
 
 #define TAG "CONN_MNGR_CTX"
 
+/*
+ * Connectionless remotes are not taken into account, as they are never
+ * connected to.
+ *
+ */
 bool ble_conn_mngr_all_remotes_found(struct ble_conn_manager_ctx* ctx)
 {
     for (size_t i = 0; i < ctx->apps_cnt; i++) {
-        if (!ctx->apps[i]->target_remote->found) {
+        if (!ctx->apps[i]->target_remote->connectionless &&
+            !ctx->apps[i]->target_remote->found) {
             return false;
         }
     }
     return true;
 }
 
+size_t ble_conn_mngr_count_missing_remotes(struct ble_conn_manager_ctx* ctx)
+{
+    size_t cnt = 0;
+
+    for (size_t i = 0; i < ctx->apps_cnt; i++) {
+        const struct ble_remote_dev* remote = ctx->apps[i]->target_remote;
+        if (remote->connectionless || remote->found) {
+            continue;
+        }
+
+        // Several apps. can target the same remote
+        bool counted = false;
+        for (size_t j = 0; j < i; j++) {
+            if (ctx->apps[j]->target_remote == remote) {
+                counted = true;
+                break;
+            }
+        }
+
+        if (!counted) {
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+bool ble_conn_mngr_scan_needed(struct ble_conn_manager_ctx* ctx)
+{
+    if (!ble_conn_mngr_all_remotes_found(ctx)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < ctx->apps_cnt; i++) {
+        if (ctx->apps[i]->target_remote->connectionless) {
+            return true;
+        }
+    }
+    return false;
+}
+
 struct ble_remote_dev* ble_conn_mngr_get_remote_by_name(
     struct ble_conn_manager_ctx* ctx,
     const char* rem_name)
@@ -39,6 +88,18 @@ struct ble_remote_dev* ble_conn_mngr_get_remote_by_name(
     return NULL;
 }
 
+struct ble_gattc_app* ble_conn_mngr_find_profile_by_remote(
+    struct ble_conn_manager_ctx* ctx,
+    const struct ble_remote_dev* remote)
+{
+    for (size_t i = 0; i < ctx->apps_cnt; i++) {
+        if (ctx->apps[i]->target_remote == remote) {
+            return ctx->apps[i];
+        }
+    }
+    return NULL;
+}
+
 struct ble_gattc_app* ble_conn_mngr_find_profile_by_if(
     struct ble_conn_manager_ctx* ctx,
     esp_gatt_if_t gattc_if)
@@ -51,23 +112,170 @@ struct ble_gattc_app* ble_conn_mngr_find_profile_by_if(
     return NULL;
 }
 
+/*
+ * Whether a connection event (e.g. a disconnection) belongs to the given app.
+ * The connection id is only known once the app. is open; before that, the
+ * remote address is the only way to tell a failed connection attempt apart.
+ *
+ */
+bool ble_conn_mngr_app_owns_conn(const struct ble_gattc_app* app,
+                                 const esp_bd_addr_t remote_bda,
+                                 uint16_t conn_id)
+{
+    if (app->state == BLE_GATTC_APP_IDLE || !app->target_remote->found) {
+        return false;
+    }
+
+    if (memcmp(app->target_remote->remote_addr,
+               remote_bda,
+               ESP_BD_ADDR_LEN) != 0) {
+        return false;
+    }
+
+    return !app->virt_conn_open || app->virt_conn_id == conn_id;
+}
+
+size_t ble_conn_mngr_count_apps_in_state(struct ble_conn_manager_ctx* ctx,
+                                          enum ble_gattc_app_state state)
+{
+    size_t cnt = 0;
+    for (size_t i = 0; i < ctx->apps_cnt; i++) {
+        if (ctx->apps[i]->state == state) {
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+size_t ble_conn_mngr_count_busy_apps(struct ble_conn_manager_ctx* ctx)
+{
+    return ble_conn_mngr_count_connected_apps(ctx) -
+           ble_conn_mngr_count_apps_in_state(ctx, BLE_GATTC_APP_SUBSCRIBED);
+}
+
+size_t ble_conn_mngr_count_connected_apps(struct ble_conn_manager_ctx* ctx)
+{
+    return ctx->apps_cnt -
+           ble_conn_mngr_count_apps_in_state(ctx, BLE_GATTC_APP_IDLE);
+}
+
+static bool ble_conn_mngr_prf_is_eligible(struct ble_gattc_app* app)
+{
+    return app->target_remote->found &&
+           !app->target_remote->connectionless &&
+           app->state == BLE_GATTC_APP_IDLE &&
+           app->gattc_if != ESP_GATT_IF_NONE;
+}
+
+static bool ble_conn_mngr_prf_urgent(const struct ble_gattc_app* app,
+                                     TickType_t now)
+{
+    if (app->expedited) {
+        return true;
+    }
+
+    return app->priority == BLE_GATTC_APP_PRIO_HIGH &&
+           (!app->deadline_valid || (int32_t)(now - app->deadline) >= 0);
+}
+
+/*
+ * Whether @p a goes before @p b. Expedited and due high priority apps. go
+ * first. Otherwise, apps. never serviced are due already, and apps. without a
+ * period have no deadline.
+ *
+ */
+static bool ble_conn_mngr_prf_due_before(const struct ble_gattc_app* a,
+                                         const struct ble_gattc_app* b,
+                                         TickType_t now)
+{
+    bool a_urgent = ble_conn_mngr_prf_urgent(a, now);
+    if (a_urgent != ble_conn_mngr_prf_urgent(b, now)) {
+        return a_urgent;
+    }
+
+    if (a->period_ms == 0) {
+        return false;
+    }
+
+    if (b->period_ms == 0) {
+        return true;
+    }
+
+    if (!a->deadline_valid || !b->deadline_valid) {
+        return !a->deadline_valid && b->deadline_valid;
+    }
+
+    // Tick count wrap-safe comparison.
+    return (int32_t)(a->deadline - b->deadline) < 0;
+}
+
+/*
+ * Earliest deadline first. The search starts after the last app. opened, so
+ * that apps. with the same deadline are opened round robin.
+ *
+ */
 struct ble_gattc_app* ble_conn_mngr_next_prf(struct ble_conn_manager_ctx* ctx)
 {
-    for (size_t idx = ctx->curr_prf_idx + 1; idx < ctx->apps_cnt; idx++) {
-        if (ctx->apps[idx]->target_remote->found) {
-            LOG_DBG("next profile index = %d, found = %d", idx, ctx->apps[idx]->target_remote->found ? 1 : 0);
-            ctx->curr_prf_idx = idx;
-            return ctx->apps[idx];
+    struct ble_gattc_app* next = NULL;
+    size_t next_idx = 0;
+    TickType_t now = xTaskGetTickCount();
+
+    for (size_t i = 1; i <= ctx->apps_cnt; i++) {
+        size_t idx = (ctx->curr_prf_idx + i) % ctx->apps_cnt;
+        struct ble_gattc_app* app = ctx->apps[idx];
+
+        if (!ble_conn_mngr_prf_is_eligible(app)) {
+            continue;
+        }
+
+        // While paused, only the apps. that can't wait are opened.
+        if (ctx->paused && !ble_conn_mngr_prf_urgent(app, now)) {
+            continue;
+        }
+
+        if (next == NULL || ble_conn_mngr_prf_due_before(app, next, now)) {
+            next = app;
+            next_idx = idx;
         }
     }
 
-    for (size_t idx = 0; idx <= ctx->curr_prf_idx; idx++) {
-        if (ctx->apps[idx]->target_remote->found) {
-            LOG_DBG("next profile index = %d, found = %d", idx, ctx->apps[idx]->target_remote->found ? 1 : 0);
-            ctx->curr_prf_idx = idx;
-            return ctx->apps[idx];
+    if (next != NULL) {
+        LOG_DBG("next profile index = %d", next_idx);
+        ctx->curr_prf_idx = next_idx;
+    }
+
+    return next;
+}
+
+/*
+ * Account for a value received by the app. and set its next deadline, one
+ * period from now.
+ *
+ */
+void ble_conn_mngr_sched_sample(struct ble_gattc_app* app)
+{
+    app->stats.samples++;
+    app->expedited = false;
+
+    if (app->period_ms == 0) {
+        return;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    if (app->deadline_valid && (int32_t)(now - app->deadline) > 0) {
+        uint32_t lateness_ms = pdTICKS_TO_MS(now - app->deadline);
+
+        app->stats.missed_deadlines++;
+        app->stats.total_lateness_ms += lateness_ms;
+        if (lateness_ms > app->stats.max_lateness_ms) {
+            app->stats.max_lateness_ms = lateness_ms;
         }
+
+        LOG_DBG("%s: deadline missed by %lu ms",
+                app->target_remote->name,
+                lateness_ms);
     }
 
-    return NULL;
+    app->deadline = now + pdMS_TO_TICKS(app->period_ms);
+    app->deadline_valid = true;
 }
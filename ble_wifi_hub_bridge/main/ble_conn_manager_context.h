@@ -1,30 +1,86 @@
 #ifndef BLE_CONN_MANAGER_CONTEXT_H
 #define BLE_CONN_MANAGER_CONTEXT_H
 
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+
 #include "ble_conn_manager.h"
+#include "spsc_ring.h"
+
+/**
+ * @brief BLE event pipeline statistics. The residency is the time spent in
+ * the BLE stack callbacks, i.e. the time the BT host task is held. Lifecycle
+ * events are the ones that are neither scan results nor notifications.
+ *
+ */
+struct ble_conn_manager_event_stats
+{
+    uint32_t events;
+    uint32_t dropped_scan_results;
+    uint32_t dropped_notifications;
+    uint32_t dropped_lifecycle;
+    uint32_t resyncs; // App. states resynchronized after an overflow
+    uint32_t max_pending;
+    uint32_t max_cb_residency_us;
+};
 
 struct ble_conn_manager_ctx
 {
     struct ble_gattc_app** apps;
     size_t apps_cnt;
     size_t curr_prf_idx;
+    size_t max_conns;
     bool scanning;
-    bool opening;
-    bool closing;
     esp_ble_scan_params_t ble_scan_params;
     struct gap_ev_functor* gap_ev_functor;
+    struct adv_data_functor* adv_data_functor;
+    struct spsc_ring event_ring;
+    TaskHandle_t event_task;
+    struct ble_conn_manager_event_stats event_stats;
+    atomic_bool event_ring_overflowed;
+    volatile bool paused;
+    volatile bool pause_until_resumed; // Without the event task only
+    TimerHandle_t resume_timer;
+    StaticTimer_t resume_timer_buf;
+    SemaphoreHandle_t pause_sem;
+    StaticSemaphore_t pause_sem_buf;
 };
 
 bool ble_conn_mngr_all_remotes_found(struct ble_conn_manager_ctx* ctx);
 
+size_t ble_conn_mngr_count_missing_remotes(struct ble_conn_manager_ctx* ctx);
+
+bool ble_conn_mngr_scan_needed(struct ble_conn_manager_ctx* ctx);
+
 struct ble_remote_dev* ble_conn_mngr_get_remote_by_name(
     struct ble_conn_manager_ctx* ctx,
     const char* rem_name);
 
+struct ble_gattc_app* ble_conn_mngr_find_profile_by_remote(
+    struct ble_conn_manager_ctx* ctx,
+    const struct ble_remote_dev* remote);
+
 struct ble_gattc_app* ble_conn_mngr_find_profile_by_if(
     struct ble_conn_manager_ctx* ctx,
     esp_gatt_if_t gattc_if);
 
+bool ble_conn_mngr_app_owns_conn(const struct ble_gattc_app* app,
+                                 const esp_bd_addr_t remote_bda,
+                                 uint16_t conn_id);
+
+size_t ble_conn_mngr_count_apps_in_state(struct ble_conn_manager_ctx* ctx,
+                                          enum ble_gattc_app_state state);
+
+size_t ble_conn_mngr_count_busy_apps(struct ble_conn_manager_ctx* ctx);
+
+size_t ble_conn_mngr_count_connected_apps(struct ble_conn_manager_ctx* ctx);
+
 struct ble_gattc_app* ble_conn_mngr_next_prf(struct ble_conn_manager_ctx* ctx);
 
+void ble_conn_mngr_sched_sample(struct ble_gattc_app* app);
+
 #endif /* BLE_CONN_MANAGER_CONTEXT_H */
@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "nvs.h"
+#include "esp_log.h"
+
+#include "ble_handle_cache.h"
+#include "log_helpers.h"
+
+#define TAG "HANDLE_CACHE"
+#define NVS_NAMESPACE "ble_hcache"
+
+// NVS keys are limited to 15 chars., the address in hex. takes 12.
+#define NVS_KEY_LEN (ESP_BD_ADDR_LEN * 2 + 1)
+
+static void ble_handle_cache_get_key(const esp_bd_addr_t addr,
+                                     char key[NVS_KEY_LEN])
+{
+    for (size_t i = 0; i < ESP_BD_ADDR_LEN; i++) {
+        snprintf(&key[i * 2], NVS_KEY_LEN - i * 2, "%02x", addr[i]);
+    }
+}
+
+esp_err_t ble_handle_cache_load(const esp_bd_addr_t addr,
+                                struct ble_handle_cache_entry* entry)
+{
+    nvs_handle_t nvs = 0;
+    esp_err_t rc = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (rc == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_ERR_NOT_FOUND;
+    } else if (rc != ESP_OK) {
+        return rc;
+    }
+
+    char key[NVS_KEY_LEN] = {0};
+    ble_handle_cache_get_key(addr, key);
+
+    size_t len = sizeof(*entry);
+    rc = nvs_get_blob(nvs, key, entry, &len);
+    nvs_close(nvs);
+
+    if (rc == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (rc == ESP_OK && len != sizeof(*entry)) {
+        LOG_ERR("entry %s has unexpected size %d", key, len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return rc;
+}
+
+esp_err_t ble_handle_cache_store(const esp_bd_addr_t addr,
+                                 const struct ble_handle_cache_entry* entry)
+{
+    nvs_handle_t nvs = 0;
+    esp_err_t rc = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+
+    char key[NVS_KEY_LEN] = {0};
+    ble_handle_cache_get_key(addr, key);
+
+    rc = nvs_set_blob(nvs, key, entry, sizeof(*entry));
+    if (rc == ESP_OK) {
+        rc = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+
+    LOG_DBG("stored entry %s, error %d", key, rc);
+
+    return rc;
+}
+
+esp_err_t ble_handle_cache_erase(const esp_bd_addr_t addr)
+{
+    nvs_handle_t nvs = 0;
+    esp_err_t rc = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+
+    char key[NVS_KEY_LEN] = {0};
+    ble_handle_cache_get_key(addr, key);
+
+    rc = nvs_erase_key(nvs, key);
+    if (rc == ESP_OK) {
+        rc = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+
+    LOG_DBG("erased entry %s, error %d", key, rc);
+
+    return rc;
+}
@@ -0,0 +1,56 @@
+/**
+ * @brief Persistent cache of the GATT handles of the BLE remotes, keyed by
+ * their BD address and kept in NVS. It allows skipping the service discovery
+ * and, when the char. value fits in the default ATT MTU, the MTU exchange of a
+ * reconnection.
+ *
+ */
+
+#ifndef BLE_HANDLE_CACHE_H
+#define BLE_HANDLE_CACHE_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_bt_defs.h"
+
+#define BLE_HANDLE_CACHE_MAX_CHARS 4
+
+/**
+ * @brief Handles and connection parameters of a remote.
+ *
+ */
+struct ble_handle_cache_entry
+{
+    uint16_t start_handle;
+    uint16_t end_handle;
+    uint16_t char_handles[BLE_HANDLE_CACHE_MAX_CHARS];
+    uint16_t char_cnt;
+    uint16_t cccd_handle;
+    uint16_t max_value_len;
+};
+
+/**
+ * @brief Load the entry of the remote with address @p addr.
+ *
+ * @return ESP_OK if found, ESP_ERR_NOT_FOUND if there is no entry for it or
+ * an NVS error otherwise.
+ */
+esp_err_t ble_handle_cache_load(const esp_bd_addr_t addr,
+                                struct ble_handle_cache_entry* entry);
+
+/**
+ * @brief Store (or overwrite) the entry of the remote with address @p addr.
+ *
+ */
+esp_err_t ble_handle_cache_store(const esp_bd_addr_t addr,
+                                 const struct ble_handle_cache_entry* entry);
+
+/**
+ * @brief Remove the entry of the remote with address @p addr, e.g. because
+ * its handles are not valid anymore.
+ *
+ */
+esp_err_t ble_handle_cache_erase(const esp_bd_addr_t addr);
+
+#endif /* BLE_HANDLE_CACHE_H */
@@ -19,17 +19,69 @@
 #include "freertos/FreeRTOS.h"
 
 #include "sensors_cache.h"
+#include "sensors_publisher.h"
 #include "ble_sensors_reader.h"
 #include "log_helpers.h"
 
 #define TAG "BLE_SENS_RDR"
 
-static bool ble_sens_rd_all_found_sensors_polled(
-    struct ble_sensors_reader* ble_sens_rd)
+// Format of the sensor data advertised by ble_edge_dev (see its README).
+#define ADV_SENSOR_COMPANY_ID 0xFFFF
+#define ADV_SENSOR_VERSION 0x01
+#define ADV_SENSOR_DATA_LEN 7
+
+// Number of publishing cycles between scheduling statistics logs.
+#define STATS_LOG_CYCLES 10
+
+#if defined(CONFIG_BLE_SENSORS_READER_FAST_LANE)
+#define FAST_LANE_ENABLED true
+#else
+#define FAST_LANE_ENABLED false
+#endif
+
+#if defined(CONFIG_UDP_SENSOR_SERVER_ALWAYS_ON)
+#define UDP_ALWAYS_ON_ENABLED true
+#else
+#define UDP_ALWAYS_ON_ENABLED false
+#endif
+
+#if defined(CONFIG_UDP_SENSOR_SERVER_MIN_WINDOW_MS)
+#define UDP_MIN_WINDOW_MS CONFIG_UDP_SENSOR_SERVER_MIN_WINDOW_MS
+#else
+#define UDP_MIN_WINDOW_MS 0
+#endif
+
+#define STALE_PERIODS CONFIG_BLE_SENSORS_READER_STALE_PERIODS
+
+/*
+ * Connectionless sensors are not part of the cycle, as they are only updated
+ * while scanning.
+ *
+ */
+static bool ble_sens_rd_sensor_in_cycle(const struct ble_remote_sensor* rs)
+{
+    return rs->found && !rs->remote->connectionless;
+}
+
+static bool ble_sens_rd_sensor_fresh(const struct ble_remote_sensor* rs,
+                                     TickType_t now)
+{
+    if (!rs->polled) {
+        return false;
+    }
+
+    return rs->period_ms == 0 ||
+           pdTICKS_TO_MS(now - rs->sampled_at) < rs->period_ms;
+}
+
+static bool ble_sens_rd_all_found_sensors_fresh(
+    struct ble_sensors_reader* ble_sens_rd,
+    TickType_t now)
 {
     for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
-        if (ble_sens_rd->remote_sensors[i].found &&
-            !ble_sens_rd->remote_sensors[i].polled) {
+        struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (ble_sens_rd_sensor_in_cycle(rs) &&
+            !ble_sens_rd_sensor_fresh(rs, now)) {
             return false;
         }
     }
@@ -37,38 +89,293 @@ static bool ble_sens_rd_all_found_sensors_polled(
     return true;
 }
 
+/*
+ * Sensors with a period are polled again once they are due, so they are
+ * not reset.
+ *
+ */
 static void ble_sens_rd_mark_sensors_unpolled(
     struct ble_sensors_reader* ble_sens_rd)
 {
     for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
-        ble_sens_rd->remote_sensors[i].polled = false;
+        if (ble_sens_rd->remote_sensors[i].period_ms == 0) {
+            ble_sens_rd->remote_sensors[i].polled = false;
+        }
     }
 }
 
+/*
+ * The UDP server runs until the first sensor is due, so that it doesn't
+ * delay its poll. Alarms are published until the first high priority sensor
+ * is due instead (whether it's connectionless or not). Either way, a window
+ * lasts CONFIG_UDP_SENSOR_SERVER_MIN_WINDOW_MS at least, so that short
+ * periods don't leave the clients without one.
+ *
+ */
+static uint32_t ble_sens_rd_publish_window_ms(
+    struct ble_sensors_reader* ble_sens_rd,
+    TickType_t now,
+    bool high_prio_only)
+{
+    uint32_t window_ms = CONFIG_UDP_SENSOR_SERVER_TIMEOUT;
+
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (rs->period_ms == 0 || !rs->sampled) {
+            continue;
+        }
+
+        if (high_prio_only ? (!rs->found ||
+                              rs->priority != BLE_GATTC_APP_PRIO_HIGH)
+                           : !ble_sens_rd_sensor_in_cycle(rs)) {
+            continue;
+        }
+
+        uint32_t age_ms = pdTICKS_TO_MS(now - rs->sampled_at);
+        uint32_t left_ms = age_ms < rs->period_ms ? rs->period_ms - age_ms : 0;
+        if (left_ms < window_ms) {
+            window_ms = left_ms;
+        }
+    }
+
+    return window_ms < UDP_MIN_WINDOW_MS ? UDP_MIN_WINDOW_MS : window_ms;
+}
+
 static void ble_sens_rd_handle_srv_search_cmpl(struct ble_gattc_app* app,
                                                esp_gattc_cb_event_t event,
                                                esp_ble_gattc_cb_param_t* param)
 {
-    int rc = esp_ble_gattc_read_char(app->gattc_if,
-                                     app->virt_conn_id,
-                                     app->target_service.target_char.handle,
-                                     ESP_GATT_AUTH_REQ_NONE);
-    if (rc != ESP_GATT_OK) {
+#if defined(CONFIG_BLE_SENSORS_READER_SUBSCRIBE)
+    // Keep the connection and let the remote push its value. If there are no
+    // connections left for it, just read it as usual.
+    esp_err_t err = ble_conn_mngr_subscribe(app);
+    if (err == ESP_OK) {
+        return;
+    }
+    LOG_DBG("could not subscribe %s (%d), reading instead",
+            app->target_remote->name,
+            err);
+#endif
+
+    esp_err_t rc = ble_conn_mngr_read(app);
+    if (rc != ESP_OK) {
         LOG_ERR("issue read char failed, error status = %x", rc);
         ble_conn_mngr_close(app);
     }
 }
 
-static enum sensor ble_sens_rd_find_gattc_app_sensor_id(
-    const struct ble_sensors_reader* ble_sens_rd,
-    struct ble_gattc_app* app)
+static struct ble_remote_sensor* ble_sens_rd_find_remote_sensor(
+    struct ble_sensors_reader* ble_sens_rd,
+    const struct ble_remote_dev* remote)
+{
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        if (remote == ble_sens_rd->remote_sensors[i].remote) {
+            return &ble_sens_rd->remote_sensors[i];
+        }
+    }
+    return NULL;
+}
+
+static void ble_sens_rd_store_value(struct ble_remote_sensor* rem_sens,
+                                    sensor_val_t val)
+{
+    if (!sensors_cache_registered(rem_sens->sensor)) {
+        LOG_ERR("unregistered sensor ID %d", (int)rem_sens->sensor);
+        return;
+    }
+
+    sensor_val_t prev_val = {0};
+    sensors_cache_get(rem_sens->sensor, &prev_val);
+
+    if (rem_sens->priority == BLE_GATTC_APP_PRIO_HIGH &&
+        rem_sens->sampled &&
+        !rem_sens->alarm_pending &&
+        prev_val.u16 != val.u16) {
+        rem_sens->alarm_pending = true;
+        rem_sens->alarm_since = rem_sens->sampled_at;
+        rem_sens->alarms++;
+    }
+
+    sensors_cache_set(rem_sens->sensor, val);
+    sensors_publisher_notify(rem_sens->sensor);
+
+    rem_sens->found = true;
+    rem_sens->polled = true;
+    rem_sens->sampled = true;
+    rem_sens->sampled_at = xTaskGetTickCount();
+}
+
+/*
+ * Store the values of the first @p chars_cnt chars. of the remote's profile,
+ * i.e. the 2-byte values at @p value, in their sensors.
+ *
+ */
+static void ble_sens_rd_store_char_values(
+    struct ble_sensors_reader* ble_sens_rd,
+    const struct ble_remote_dev* remote,
+    const uint8_t* value,
+    uint16_t value_len,
+    size_t chars_cnt)
+{
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (rs->remote != remote || rs->char_idx >= chars_cnt) {
+            continue;
+        }
+
+        size_t offset = rs->char_idx * sizeof(uint16_t);
+        if (offset + sizeof(uint16_t) > value_len) {
+            LOG_ERR("%s: no value for char. %d, len = %d",
+                    remote->name,
+                    rs->char_idx,
+                    value_len);
+            continue;
+        }
+
+        sensor_val_t val = { .u16 = value[offset] | (value[offset + 1] << 8) };
+        ble_sens_rd_store_value(rs, val);
+
+        LOG_INF("%s: char. %d value = %d",
+                remote->name,
+                rs->char_idx,
+                val.u16);
+    }
+}
+
+static bool ble_sens_rd_alarm_pending(struct ble_sensors_reader* ble_sens_rd)
+{
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        if (ble_sens_rd->remote_sensors[i].alarm_pending) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Pending alarms are available to the UDP clients from now on.
+ *
+ */
+static void ble_sens_rd_account_alarms(struct ble_sensors_reader* ble_sens_rd,
+                                       TickType_t now)
 {
     for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
-        if (app->target_remote == ble_sens_rd->remote_sensors[i].remote) {
-            return ble_sens_rd->remote_sensors[i].sensor;
+        struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (!rs->alarm_pending) {
+            continue;
+        }
+
+        uint32_t latency_ms = pdTICKS_TO_MS(now - rs->alarm_since);
+        if (latency_ms > rs->max_alarm_latency_ms) {
+            rs->max_alarm_latency_ms = latency_ms;
+        }
+        rs->alarm_pending = false;
+    }
+}
+
+static void ble_sens_rd_publish(struct ble_sensors_reader* ble_sens_rd,
+                                TickType_t now,
+                                uint32_t window_ms)
+{
+    ble_sens_rd_account_alarms(ble_sens_rd, now);
+    ble_sensors_rd_serve(ble_sens_rd, window_ms);
+}
+
+/*
+ * With the fast lane, alarms are published as soon as they are received,
+ * without waiting for the rest of the sensors. The always-on UDP server
+ * publishes every value as soon as it's stored, and so does a window in
+ * progress, so there is nothing to wait for then.
+ *
+ */
+static bool ble_sens_rd_publish_alarms(struct ble_sensors_reader* ble_sens_rd)
+{
+    if (!ble_sens_rd_alarm_pending(ble_sens_rd)) {
+        return false;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    if (UDP_ALWAYS_ON_ENABLED || ble_conn_mngr_paused()) {
+        ble_sens_rd_account_alarms(ble_sens_rd, now);
+        return false;
+    }
+
+    if (!FAST_LANE_ENABLED) {
+        return false;
+    }
+
+    LOG_DBG("publishing alarm");
+
+    ble_sens_rd_publish(ble_sens_rd,
+                        now,
+                        ble_sens_rd_publish_window_ms(ble_sens_rd, now, true));
+    return true;
+}
+
+/*
+ * Launch the UDP server once all the found sensors are fresh, i.e. they have
+ * been polled within their period (or during this cycle, if they have none).
+ *
+ */
+static void ble_sens_rd_publish_if_all_fresh(
+    struct ble_sensors_reader* ble_sens_rd)
+{
+    static uint32_t cycles = 0;
+
+    if (ble_sens_rd_publish_alarms(ble_sens_rd)) {
+        return;
+    }
+
+    // Serving or keeping the pace already: the cycle goes on once resumed
+    if (ble_conn_mngr_paused()) {
+        LOG_DBG("paused, not publishing");
+        return;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    if (!ble_sens_rd_all_found_sensors_fresh(ble_sens_rd, now)) {
+        LOG_DBG("not all found sensors fresh yet");
+        return;
+    }
+
+    LOG_DBG("all sensors fresh");
+
+    ble_sens_rd_mark_sensors_unpolled(ble_sens_rd);
+
+    if (++cycles % STATS_LOG_CYCLES == 0) {
+        ble_conn_mngr_log_stats();
+        ble_sensors_rd_log_stats(ble_sens_rd);
+        udp_sensor_server_log_stats(ble_sens_rd->udp_sensor_server);
+    }
+
+    ble_sens_rd_publish(ble_sens_rd,
+                        now,
+                        ble_sens_rd_publish_window_ms(ble_sens_rd, now, false));
+}
+
+/*
+ * An expedited app. done without a value (see ble_gattc_app::expedited) won't
+ * refresh its sensors: let the UDP server answer the requests waiting for
+ * them with the values there are.
+ *
+ */
+static void ble_sens_rd_check_refresh(struct ble_sensors_reader* ble_sens_rd,
+                                      const struct ble_gattc_app* app)
+{
+    if (!app->expedited) {
+        return;
+    }
+
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        const struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (rs->remote != app->target_remote) {
+            continue;
         }
+
+        LOG_DBG("%s: refresh failed, sensor %d", rs->remote->name, rs->sensor);
+        udp_sensor_server_refresh_failed(ble_sens_rd->udp_sensor_server,
+                                         rs->sensor);
     }
-    return SENSOR_NONE;
 }
 
 static void ble_sens_rd_handle_read_char(
@@ -78,32 +385,45 @@ static void ble_sens_rd_handle_read_char(
     struct ble_sensors_reader* ble_sens_rd)
 {
     if (param->read.status != ESP_GATT_OK) {
-        LOG_ERR("read char failed, error status = %x", param->write.status);
+        LOG_ERR("read char failed, error status = %x", param->read.status);
+        ble_sens_rd_check_refresh(ble_sens_rd, app);
         ble_conn_mngr_close(app);
         return;
     }
 
-    sensor_val_t rd_val = { .u16 = *((uint16_t*)param->read.value) };
+    // A read multiple response holds the values of all the chars. in order.
+    ble_sens_rd_store_char_values(ble_sens_rd,
+                                  app->target_remote,
+                                  param->read.value,
+                                  param->read.value_len,
+                                  app->target_service.target_chars_cnt);
 
-    enum sensor sens_id = ble_sens_rd_find_gattc_app_sensor_id(
-        ble_sens_rd,
-        app);
-
-    if (sens_id >= SENSOR_NONE) {
-        LOG_ERR("invalid sensor ID %d", (int)sens_id);
-    } else {
-        sensors_cache_set(sens_id, rd_val);
+    ble_conn_mngr_close(app);
+}
 
-        ble_sens_rd->remote_sensors[sens_id].found = true;
-        ble_sens_rd->remote_sensors[sens_id].polled = true;
+static void ble_sens_rd_handle_notify(
+    struct ble_gattc_app* app,
+    esp_gattc_cb_event_t event,
+    esp_ble_gattc_cb_param_t* param,
+    struct ble_sensors_reader* ble_sens_rd)
+{
+    // Only the first char. is subscribed to.
+    if (param->notify.handle != app->target_service.target_chars[0].handle) {
+        LOG_ERR("unexpected notification, handle = %d, len = %d",
+                param->notify.handle,
+                param->notify.value_len);
+        return;
     }
 
-    LOG_INF("%s read value = %d, len = %d",
-            app->target_remote->name,
-            rd_val.u16,
-            param->read.value_len);
+    ble_sens_rd_store_char_values(ble_sens_rd,
+                                  app->target_remote,
+                                  param->notify.value,
+                                  param->notify.value_len,
+                                  1);
 
-    ble_conn_mngr_close(app);
+    // Subscribed remotes are never closed, so the cycle must be checked here
+    // as well.
+    ble_sens_rd_publish_if_all_fresh(ble_sens_rd);
 }
 
 static void ble_sens_rd_handle_close(
@@ -112,20 +432,75 @@ static void ble_sens_rd_handle_close(
     esp_ble_gattc_cb_param_t* param,
     struct ble_sensors_reader* ble_sens_rd)
 {
-    if (!ble_sens_rd_all_found_sensors_polled(ble_sens_rd)) {
-        LOG_DBG("not all found sensors polled yet");
+    ble_sens_rd_check_refresh(ble_sens_rd, app);
+    ble_sens_rd_publish_if_all_fresh(ble_sens_rd);
+}
+
+/*
+ * The sensor's value is stale until it's read again, and it's left out of the
+ * cycle meanwhile.
+ *
+ */
+static void ble_sens_rd_lose_sensor(struct ble_remote_sensor* rs)
+{
+    rs->found = false;
+    sensors_cache_invalidate(rs->sensor);
+    sensors_publisher_notify(rs->sensor);
+}
+
+/*
+ * The remote dropped out of the found set: its values are stale until it's
+ * found and read again, and it's left out of the cycle meanwhile.
+ *
+ */
+static void ble_sens_rd_handle_disconnect(
+    struct ble_gattc_app* app,
+    esp_gattc_cb_event_t event,
+    esp_ble_gattc_cb_param_t* param,
+    struct ble_sensors_reader* ble_sens_rd)
+{
+    ble_sens_rd_check_refresh(ble_sens_rd, app);
+
+    if (app->target_remote->found) {
         return;
     }
 
-    LOG_DBG("all sensors polled");
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (rs->remote != app->target_remote || !rs->found) {
+            continue;
+        }
 
-    ble_sens_rd_mark_sensors_unpolled(ble_sens_rd);
+        LOG_WRN("%s: lost, sensor %d stale", rs->remote->name, rs->sensor);
+
+        ble_sens_rd_lose_sensor(rs);
+    }
+
+    ble_sens_rd_publish_if_all_fresh(ble_sens_rd);
+}
+
+void ble_sensors_rd_expire_stale(struct ble_sensors_reader* ble_sens_rd)
+{
+    TickType_t now = xTaskGetTickCount();
+
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (!rs->found || !rs->sampled || rs->period_ms == 0) {
+            continue;
+        }
+
+        uint32_t age_ms = pdTICKS_TO_MS(now - rs->sampled_at);
+        if (age_ms <= STALE_PERIODS * rs->period_ms) {
+            continue;
+        }
 
-    LOG_DBG("launching UDP server");
+        LOG_WRN("%s: not sampled for %lu ms, sensor %d stale",
+                rs->remote->name,
+                age_ms,
+                rs->sensor);
 
-    const uint32_t period_ms = CONFIG_UDP_SENSOR_SERVER_TIMEOUT;
-    udp_sensor_server_accept_requests(
-        ble_sens_rd->udp_sensor_server, period_ms);
+        ble_sens_rd_lose_sensor(rs);
+    }
 }
 
 void ble_sensors_rd_gattc_event_handler(struct ble_gattc_app* app,
@@ -135,23 +510,179 @@ void ble_sensors_rd_gattc_event_handler(struct ble_gattc_app* app,
 {
     struct ble_sensors_reader* us_args = (struct ble_sensors_reader*)user_args;
 
+    ble_sensors_rd_expire_stale(us_args);
+
     switch (event) {
     case ESP_GATTC_SEARCH_CMPL_EVT: {
         ble_sens_rd_handle_srv_search_cmpl(app, event, param);
         break;
     }
 
-    case ESP_GATTC_READ_CHAR_EVT: {
+    case ESP_GATTC_OPEN_EVT: {
+        // Only failed opens are passed on
+        ble_sens_rd_check_refresh(us_args, app);
+        break;
+    }
+
+    case ESP_GATTC_READ_CHAR_EVT:
+    case ESP_GATTC_READ_MULTIPLE_EVT: {
         ble_sens_rd_handle_read_char(app, event, param, us_args);
         break;
     }
 
+    case ESP_GATTC_NOTIFY_EVT: {
+        ble_sens_rd_handle_notify(app, event, param, us_args);
+        break;
+    }
+
     case ESP_GATTC_CLOSE_EVT: {
         ble_sens_rd_handle_close(app, event, param, us_args);
         break;
     }
 
+    case ESP_GATTC_DISCONNECT_EVT: {
+        ble_sens_rd_handle_disconnect(app, event, param, us_args);
+        break;
+    }
+
     default:
         break;
     }
 }
+
+void ble_sensors_rd_setup_sched(const struct ble_sensors_reader* ble_sens_rd,
+                                struct ble_gattc_app* apps[],
+                                size_t cnt)
+{
+    for (size_t i = 0; i < cnt; i++) {
+        apps[i]->period_ms = 0;
+        apps[i]->priority = BLE_GATTC_APP_PRIO_NORMAL;
+
+        for (size_t j = 0; j < ble_sens_rd->remote_sensors_size; j++) {
+            const struct ble_remote_sensor* rs =
+                &ble_sens_rd->remote_sensors[j];
+            if (rs->remote != apps[i]->target_remote) {
+                continue;
+            }
+
+            if (FAST_LANE_ENABLED && rs->priority > apps[i]->priority) {
+                apps[i]->priority = rs->priority;
+            }
+
+            if (rs->period_ms == 0) {
+                continue;
+            }
+
+            if (apps[i]->period_ms == 0 || rs->period_ms < apps[i]->period_ms) {
+                apps[i]->period_ms = rs->period_ms;
+            }
+        }
+    }
+}
+
+void ble_sensors_rd_expedite(enum sensor s, void* user_args)
+{
+    const struct ble_sensors_reader* ble_sens_rd =
+        (const struct ble_sensors_reader*)user_args;
+
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        const struct ble_remote_sensor* rem_sens =
+            &ble_sens_rd->remote_sensors[i];
+
+        if (rem_sens->sensor == s) {
+            LOG_DBG("%s: expedited", rem_sens->remote->name);
+            ble_conn_mngr_expedite(rem_sens->remote);
+        }
+    }
+}
+
+void ble_sensors_rd_serve(struct ble_sensors_reader* ble_sens_rd,
+                          uint32_t max_ms)
+{
+    LOG_DBG("launching UDP server for %lu ms at most", max_ms);
+
+    if (udp_sensor_server_accept_requests(ble_sens_rd->udp_sensor_server,
+                                          max_ms,
+                                          ble_conn_mngr_missing_remotes())) {
+        // Resumed by the window end functor
+        ble_conn_mngr_pause(BLE_CONN_MNGR_UNTIL_RESUMED);
+    } else {
+        // The always-on server keeps serving meanwhile
+        ble_conn_mngr_pause(max_ms);
+    }
+}
+
+void ble_sensors_rd_window_end(void* user_args)
+{
+    ble_conn_mngr_resume();
+}
+
+void ble_sensors_rd_log_stats(const struct ble_sensors_reader* ble_sens_rd)
+{
+    for (size_t i = 0; i < ble_sens_rd->remote_sensors_size; i++) {
+        const struct ble_remote_sensor* rs = &ble_sens_rd->remote_sensors[i];
+        if (rs->priority != BLE_GATTC_APP_PRIO_HIGH) {
+            continue;
+        }
+
+        LOG_INF("%s: %lu alarms, worst alarm-to-publish latency %lu ms "
+                "(fast lane %s)",
+                rs->remote->name,
+                rs->alarms,
+                rs->max_alarm_latency_ms,
+                FAST_LANE_ENABLED ? "on" : "off");
+    }
+}
+
+void ble_sensors_rd_adv_data_handler(struct ble_remote_dev* remote,
+                                     const uint8_t* data,
+                                     uint8_t len,
+                                     void* user_args)
+{
+    struct ble_sensors_reader* ble_sens_rd =
+        (struct ble_sensors_reader*)user_args;
+
+    ble_sensors_rd_expire_stale(ble_sens_rd);
+
+    if (len < ADV_SENSOR_DATA_LEN) {
+        LOG_DBG("%s: adv. data too short (%d)", remote->name, len);
+        return;
+    }
+
+    uint16_t company_id = data[0] | (data[1] << 8);
+    if (company_id != ADV_SENSOR_COMPANY_ID || data[2] != ADV_SENSOR_VERSION) {
+        LOG_DBG("%s: unknown adv. data %04x, version %d",
+                remote->name,
+                company_id,
+                data[2]);
+        return;
+    }
+
+    struct ble_remote_sensor* rem_sens = ble_sens_rd_find_remote_sensor(
+        ble_sens_rd,
+        remote);
+    if (rem_sens == NULL) {
+        LOG_ERR("no sensor for remote %s", remote->name);
+        return;
+    }
+
+    // The same advertisement is received several times until the remote
+    // updates it.
+    uint16_t seq = data[3] | (data[4] << 8);
+    if (rem_sens->adv_seq_valid && rem_sens->adv_seq == seq) {
+        return;
+    }
+    rem_sens->adv_seq = seq;
+    rem_sens->adv_seq_valid = true;
+
+    sensor_val_t adv_val = { .u16 = data[5] | (data[6] << 8) };
+
+    ble_sens_rd_store_value(rem_sens, adv_val);
+
+    ble_sens_rd_publish_alarms(ble_sens_rd);
+
+    LOG_INF("%s advertised value = %d, seq. = %d",
+            remote->name,
+            adv_val.u16,
+            seq);
+}
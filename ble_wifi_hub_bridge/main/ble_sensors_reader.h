@@ -5,20 +5,64 @@
 #include "udp_sensor_server.h"
 #include "sensors_cache.h"
 
-#define DECL_BLE_REMOTE_SENSOR(remote_ptr, sensor_id)   \
+#define DECL_BLE_REMOTE_SENSOR(remote_ptr, sensor_id, period) \
+    DECL_BLE_REMOTE_SENSOR_PRIO(remote_ptr,                   \
+                                sensor_id,                    \
+                                period,                       \
+                                BLE_GATTC_APP_PRIO_NORMAL)
+
+#define DECL_BLE_REMOTE_SENSOR_PRIO(remote_ptr, sensor_id, period, prio) \
+    DECL_BLE_REMOTE_SENSOR_CHAR(remote_ptr, sensor_id, 0, period, prio)
+
+#define DECL_BLE_REMOTE_SENSOR_CHAR(remote_ptr, sensor_id, idx, period, prio) \
 {                                                       \
     .remote = remote_ptr,                               \
     .sensor = sensor_id,                                \
+    .char_idx = idx,                                    \
+    .priority = prio,                                   \
+    .period_ms = period,                                \
     .found = false,                                     \
-    .polled = false                                     \
+    .polled = false,                                    \
+    .sampled = false,                                   \
+    .sampled_at = 0,                                    \
+    .alarm_pending = false,                             \
+    .alarm_since = 0,                                   \
+    .alarms = 0,                                        \
+    .max_alarm_latency_ms = 0,                          \
+    .adv_seq = 0,                                       \
+    .adv_seq_valid = false                              \
 }
 
+/**
+ * @brief Remote sensor. Its value is the 2-byte value of the char_idx-th char.
+ * of its remote's GATTC profile, so a remote with several chars. can provide
+ * several sensors, all of them read at once.
+ *
+ * It must be sampled at least every period_ms; a period of 0 means it's
+ * sampled once per publishing cycle.
+ *
+ * A change in the value of a high priority sensor is an alarm. Its latency is
+ * the time from the previous sample (the alarm may have gone off right after
+ * it) until the new value is published.
+ *
+ */
 struct ble_remote_sensor
 {
     const struct ble_remote_dev* remote;
     enum sensor sensor;
+    uint8_t char_idx;
+    enum ble_gattc_app_priority priority;
+    uint32_t period_ms;
     bool found;
     bool polled;
+    bool sampled;
+    TickType_t sampled_at;
+    bool alarm_pending;
+    TickType_t alarm_since;
+    uint32_t alarms;
+    uint32_t max_alarm_latency_ms;
+    uint16_t adv_seq;
+    bool adv_seq_valid;
 };
 
 struct ble_sensors_reader
@@ -33,4 +77,66 @@ void ble_sensors_rd_gattc_event_handler(struct ble_gattc_app* blec,
                                        esp_ble_gattc_cb_param_t* param,
                                        void* user_args);
 
+/**
+ * @brief Set the period of each GATTC app. to the shortest period of the
+ * sensors of its remote, and (with the fast lane) its priority to the highest
+ * one, so that the connection manager schedules it accordingly. Must be
+ * called before starting the connection manager.
+ *
+ */
+void ble_sensors_rd_setup_sched(const struct ble_sensors_reader* ble_sens_rd,
+                                struct ble_gattc_app* apps[],
+                                size_t cnt);
+
+/**
+ * @brief Sensor refresh handler (see udp_sensor_server.h): expedite the
+ * remote(s) of sensor @p s, so that it's read next. @p user_args is the
+ * struct ble_sensors_reader.
+ *
+ */
+void ble_sensors_rd_expedite(enum sensor s, void* user_args);
+
+/**
+ * @brief Mark as stale the sensors not sampled for
+ * CONFIG_BLE_SENSORS_READER_STALE_PERIODS of their periods, e.g. those of a
+ * connectionless remote out of range. It's run by the GATTC and advertising
+ * data handlers, and should be run from the GAP functor as well, so that
+ * sensors expire while scanning in vain.
+ *
+ */
+void ble_sensors_rd_expire_stale(struct ble_sensors_reader* ble_sens_rd);
+
+/**
+ * @brief Let the UDP server serve requests for @p max_ms at most, pausing the
+ * connection manager meanwhile (see @ref ble_conn_mngr_pause), so that the
+ * radio is left to WiFi. Returns right away. To be called from the GATTC and
+ * GAP functors, while the connection manager is not paused.
+ *
+ */
+void ble_sensors_rd_serve(struct ble_sensors_reader* ble_sens_rd,
+                          uint32_t max_ms);
+
+/**
+ * @brief Window end handler (see udp_sensor_server.h): resume the connection
+ * manager once the UDP server is done serving.
+ *
+ */
+void ble_sensors_rd_window_end(void* user_args);
+
+/**
+ * @brief Log the alarm-to-publish latency of the high priority sensors.
+ *
+ */
+void ble_sensors_rd_log_stats(const struct ble_sensors_reader* ble_sens_rd);
+
+/**
+ * @brief Advertising data handler for connectionless remotes. Decodes the
+ * sensor value advertised by a ble_edge_dev and stores it in the cache.
+ *
+ */
+void ble_sensors_rd_adv_data_handler(struct ble_remote_dev* remote,
+                                     const uint8_t* data,
+                                     uint8_t len,
+                                     void* user_args);
+
 #endif /* BLE_SENSORS_READER_H */
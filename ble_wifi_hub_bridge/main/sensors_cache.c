@@ -1,75 +1,610 @@
 #include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_random.h"
 
-#include "atomic.h"
 #include "sensors_cache.h"
 
-static atomic_t sensor_magnetic_field_val = {0};
-static atomic_t sensor_photocell_val = {0};
-static atomic_t sensor_temp_val = {0};
-static atomic_t sensor_ir_detector_val = {0};
+// ESP32 cache line size
+#define SENSORS_CACHE_LINE_SIZE 32
 
-int sensors_cache_set(enum sensor s, sensor_val_t val)
+/*
+ * A sensor's slot of the table, indexed by sensor ID. Slots are padded to a
+ * cache line, so that setting a sensor (from the BLE core) doesn't invalidate
+ * the line of its neighbours while they are being read (from the UDP core).
+ *
+ */
+struct sensors_cache_slot
 {
-    switch (s) {
-        case SENSOR_MAGNETIC_FIELD: {
-            atomic_set(
-                &sensor_magnetic_field_val, (atomic_val_t)val.u16);
-            break;
-        }
+    struct sensors_cache_entry entry;
+    uint32_t hist_cnt;      // Number of values ever set, see history below
+    bool registered;
+} __attribute__((aligned(SENSORS_CACHE_LINE_SIZE)));
 
-        case SENSOR_PHOTOCELL: {
-            atomic_set(
-                &sensor_photocell_val, (atomic_val_t)val.u16);
-            break;
-        }
+_Static_assert(sizeof(struct sensors_cache_slot) == SENSORS_CACHE_LINE_SIZE,
+               "sensor slot larger than a cache line");
 
-        case SENSOR_TEMP_DETECTOR: {
-            atomic_set(
-                &sensor_temp_val, (atomic_val_t)val.u16);
-            break;
-        }
+/*
+ * The slots, version and history are guarded by a sequence lock: writers
+ * bump seqlock to odd before changing them and back to even after, readers
+ * copy them and retry if seqlock was odd or changed meanwhile. Readers never
+ * block nor disable interrupts, and writers never wait for them. The spinlock
+ * only serializes the writers, and it keeps a writer from being preempted
+ * halfway, which would leave the readers spinning.
+ *
+ */
+static portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+static atomic_uint seqlock = 0;
 
-        case SENSOR_IR_DETECTOR: {
-            atomic_set(
-                &sensor_ir_detector_val, (atomic_val_t)val.u16);
-            break;
-        }
+static struct sensors_cache_slot slots[SENSORS_CACHE_MAX_SENSORS] = {0};
+static struct sensors_mask registered = {0};
+static size_t registered_cnt = 0;
+static uint32_t version = 0;
+
+// Set once by sensors_cache_init(), before any other task reads it
+static uint32_t boot_id = 0;
+
+/*
+ * Ring of the last values of each sensor. slots[i].hist_cnt is the number of
+ * values ever stored for sensor i, so the oldest one is at hist_cnt - LEN.
+ *
+ */
+static struct sensors_cache_sample
+    history[SENSORS_CACHE_MAX_SENSORS][CONFIG_SENSORS_CACHE_HISTORY_LEN];
+
+/*
+ * Tumbling windows of each sensor: the one being aggregated and a ring of the
+ * last finished ones, done_cnt being the number of windows ever finished (as
+ * hist_cnt for the history). A window is finished by the first set after its
+ * end; until then, readers take it as finished once its end has passed.
+ *
+ */
+struct sensors_cache_windows
+{
+    struct sensors_cache_window current;    // Not started if count is 0
+    uint32_t done_cnt;
+    struct sensors_cache_window done[CONFIG_SENSORS_CACHE_AGGREGATE_WINDOWS];
+};
+
+static struct sensors_cache_windows windows[SENSORS_CACHE_MAX_SENSORS];
+
+/*
+ * Binary response for all the sensors. Writers re-encode it, so that readers
+ * (possibly many clients) can send it as it is. The mutex is held while it's
+ * being sent; a writer that finds it taken doesn't wait, it marks the
+ * response dirty instead and the next reader re-encodes it.
+ *
+ */
+static StaticSemaphore_t snapshot_mutex_buf;
+static SemaphoreHandle_t snapshot_mutex;
+static uint8_t snapshot[SENSORS_WIRE_RESPONSE_LEN(SENSORS_CACHE_MAX_SENSORS)]
+    __attribute__((aligned(4)));
+static size_t snapshot_len;
+static TickType_t snapshot_built_at;
+static atomic_bool snapshot_dirty = false;
+
+static uint32_t sensors_cache_read_begin(void)
+{
+    uint32_t seq;
+
+    // A writer is in its critical section (on the other core): it's short
+    while ((seq = atomic_load_explicit(&seqlock, memory_order_acquire)) & 1) {
+    }
+    return seq;
+}
+
+static bool sensors_cache_read_retry(uint32_t seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&seqlock, memory_order_relaxed) != seq;
+}
+
+/*
+ * Must be called with the spinlock taken.
+ *
+ */
+static void sensors_cache_write_begin(void)
+{
+    uint32_t seq = atomic_load_explicit(&seqlock, memory_order_relaxed);
+    atomic_store_explicit(&seqlock, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void sensors_cache_write_end(void)
+{
+    uint32_t seq = atomic_load_explicit(&seqlock, memory_order_relaxed);
+    atomic_store_explicit(&seqlock, seq + 1, memory_order_release);
+}
+
+/*
+ * Add @p val, set at @p at_ms, to the aggregates of @p w. Must be called in
+ * a write section.
+ *
+ */
+static void sensors_cache_aggregate(struct sensors_cache_windows* w,
+                                    uint32_t at_ms,
+                                    uint16_t val)
+{
+    struct sensors_cache_window* cur = &w->current;
+    uint32_t start_ms =
+        at_ms - at_ms % CONFIG_SENSORS_CACHE_AGGREGATE_WINDOW_MS;
+
+    if (cur->count > 0 && cur->start_ms != start_ms) {
+        w->done[w->done_cnt++ % CONFIG_SENSORS_CACHE_AGGREGATE_WINDOWS] = *cur;
+        cur->count = 0;
+    }
+
+    if (cur->count == 0) {
+        cur->sum = 0;
+        cur->start_ms = start_ms;
+        cur->min = val;
+        cur->max = val;
+    }
+
+    cur->sum += val;
+    cur->count++;
+    if (val < cur->min) {
+        cur->min = val;
+    }
+    if (val > cur->max) {
+        cur->max = val;
+    }
+}
+
+static bool sensors_cache_valid(enum sensor s)
+{
+    return (unsigned)s < SENSORS_CACHE_MAX_SENSORS;
+}
+
+static void sensors_cache_encode_record(enum sensor s,
+                                        const struct sensors_cache_entry* entry,
+                                        TickType_t now,
+                                        struct sensors_wire_record* rec)
+{
+    rec->id = (uint16_t)s;
+    rec->value = entry->val.u16;
+    rec->seq = entry->seq;
+    rec->age_ms = entry->seq == 0
+        ? SENSORS_WIRE_AGE_UNKNOWN
+        : pdTICKS_TO_MS(now - entry->updated_at);
+    rec->flags = entry->valid ? 0 : SENSORS_WIRE_RECORD_FLAG_STALE;
+    rec->reserved = 0;
+}
+
+/*
+ * Must be called with the snapshot mutex taken. The records are encoded
+ * straight from the slots, and again if a set happens meanwhile.
+ *
+ */
+static void sensors_cache_encode_snapshot(void)
+{
+    struct sensors_wire_header hdr = {
+        .magic = SENSORS_WIRE_MAGIC,
+        .version = SENSORS_WIRE_VERSION,
+        .type = SENSORS_WIRE_TYPE_RESPONSE,
+        .boot_id = boot_id,
+    };
+    struct sensors_wire_record* recs =
+        (struct sensors_wire_record*)(snapshot + sizeof(hdr));
+
+    atomic_store_explicit(&snapshot_dirty, false, memory_order_relaxed);
+
+    TickType_t now = xTaskGetTickCount();
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
 
-        default: {
-            return -EINVAL;
+        hdr.count = 0;
+        hdr.cache_version = version;
+
+        for (int s = sensors_mask_next(&registered, 0); s >= 0;
+             s = sensors_mask_next(&registered, s + 1)) {
+            sensors_cache_encode_record(
+                (enum sensor)s, &slots[s].entry, now, &recs[hdr.count++]);
         }
+    } while (sensors_cache_read_retry(seq));
+
+    memcpy(snapshot, &hdr, sizeof(hdr));
+
+    snapshot_len = SENSORS_WIRE_RESPONSE_LEN(hdr.count);
+    snapshot_built_at = now;
+}
+
+/*
+ * Re-encode the snapshot after a write, unless it's being sent: the next
+ * reader will then.
+ *
+ */
+static void sensors_cache_refresh_snapshot(void)
+{
+    atomic_store_explicit(&snapshot_dirty, true, memory_order_relaxed);
+    if (xSemaphoreTake(snapshot_mutex, 0) == pdTRUE) {
+        sensors_cache_encode_snapshot();
+        xSemaphoreGive(snapshot_mutex);
+    }
+}
+
+void sensors_cache_init(void)
+{
+    boot_id = esp_random();
+
+    snapshot_mutex = xSemaphoreCreateMutexStatic(&snapshot_mutex_buf);
+
+    xSemaphoreTake(snapshot_mutex, portMAX_DELAY);
+    sensors_cache_encode_snapshot();
+    xSemaphoreGive(snapshot_mutex);
+}
+
+int sensors_cache_register(enum sensor s)
+{
+    if (!sensors_cache_valid(s)) {
+        return -EINVAL;
+    }
+
+    int rc = 0;
+
+    portENTER_CRITICAL(&spinlock);
+    sensors_cache_write_begin();
+
+    if (slots[s].registered) {
+        rc = -EEXIST;
+    } else {
+        slots[s].registered = true;
+        sensors_mask_set(&registered, s);
+        registered_cnt++;
+    }
+
+    sensors_cache_write_end();
+    portEXIT_CRITICAL(&spinlock);
+
+    if (rc == 0) {
+        sensors_cache_refresh_snapshot();
+    }
+
+    return rc;
+}
+
+bool sensors_cache_registered(enum sensor s)
+{
+    if (!sensors_cache_valid(s)) {
+        return false;
     }
 
+    bool tmp;
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+        tmp = slots[s].registered;
+    } while (sensors_cache_read_retry(seq));
+
+    return tmp;
+}
+
+size_t sensors_cache_get_registered(struct sensors_mask* mask)
+{
+    size_t cnt;
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+        *mask = registered;
+        cnt = registered_cnt;
+    } while (sensors_cache_read_retry(seq));
+
+    return cnt;
+}
+
+int sensors_cache_set(enum sensor s, sensor_val_t val)
+{
+    if (!sensors_cache_valid(s)) {
+        return -EINVAL;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    struct sensors_cache_slot* slot = &slots[s];
+
+    portENTER_CRITICAL(&spinlock);
+
+    if (!slot->registered) {
+        portEXIT_CRITICAL(&spinlock);
+        return -EINVAL;
+    }
+
+    sensors_cache_write_begin();
+
+    if (!slot->entry.valid || slot->entry.val.u16 != val.u16) {
+        slot->entry.changed_in = ++version;
+    }
+    slot->entry.val = val;
+    slot->entry.valid = true;
+    slot->entry.seq++;
+    slot->entry.updated_at = now;
+
+    struct sensors_cache_sample* sample =
+        &history[s][slot->hist_cnt++ % CONFIG_SENSORS_CACHE_HISTORY_LEN];
+    sample->at_ms = pdTICKS_TO_MS(now);
+    sample->val = val.u16;
+
+    sensors_cache_aggregate(&windows[s], sample->at_ms, val.u16);
+
+    sensors_cache_write_end();
+    portEXIT_CRITICAL(&spinlock);
+
+    // Values change a few times per cycle, while they can be read by many
+    // clients: pay the encoding here rather than on every request.
+    sensors_cache_refresh_snapshot();
+
     return 0;
 }
 
+int sensors_cache_invalidate(enum sensor s)
+{
+    if (!sensors_cache_valid(s)) {
+        return -EINVAL;
+    }
+
+    struct sensors_cache_slot* slot = &slots[s];
+    bool changed = false;
+
+    portENTER_CRITICAL(&spinlock);
+
+    if (!slot->registered) {
+        portEXIT_CRITICAL(&spinlock);
+        return -EINVAL;
+    }
+
+    if (slot->entry.valid) {
+        sensors_cache_write_begin();
+        slot->entry.valid = false;
+        slot->entry.changed_in = ++version;
+        sensors_cache_write_end();
+        changed = true;
+    }
+
+    portEXIT_CRITICAL(&spinlock);
+
+    if (changed) {
+        sensors_cache_refresh_snapshot();
+    }
+
+    return 0;
+}
+
+int sensors_cache_get_entry(enum sensor s, struct sensors_cache_entry* entry)
+{
+    if (!sensors_cache_valid(s)) {
+        return -EINVAL;
+    }
+
+    bool reg;
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+        reg = slots[s].registered;
+        *entry = slots[s].entry;
+    } while (sensors_cache_read_retry(seq));
+
+    return reg ? 0 : -EINVAL;
+}
+
 int sensors_cache_get(enum sensor s, sensor_val_t* val)
 {
-    switch (s) {
-        case SENSOR_MAGNETIC_FIELD: {
-            val->u16 = atomic_get(&sensor_magnetic_field_val).u16;
-            break;
+    struct sensors_cache_entry entry;
+
+    int rc = sensors_cache_get_entry(s, &entry);
+    if (rc < 0) {
+        return rc;
+    }
+
+    *val = entry.val;
+    return 0;
+}
+
+int sensors_cache_get_record(enum sensor s,
+                             TickType_t now,
+                             struct sensors_wire_record* rec)
+{
+    struct sensors_cache_entry entry;
+
+    int rc = sensors_cache_get_entry(s, &entry);
+    if (rc < 0) {
+        return rc;
+    }
+
+    sensors_cache_encode_record(s, &entry, now, rec);
+    return 0;
+}
+
+uint32_t sensors_cache_version(void)
+{
+    uint32_t tmp;
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+        tmp = version;
+    } while (sensors_cache_read_retry(seq));
+
+    return tmp;
+}
+
+uint32_t sensors_cache_boot_id(void)
+{
+    return boot_id;
+}
+
+void sensors_cache_get_snapshot(struct sensors_cache_snapshot* snap,
+                                const struct sensors_mask* mask)
+{
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+
+        if (mask == NULL) {
+            mask = &registered;
         }
 
-        case SENSOR_PHOTOCELL: {
-            val->u16 = atomic_get(&sensor_photocell_val).u16;
-            break;
+        for (int s = sensors_mask_next(mask, 0); s >= 0;
+             s = sensors_mask_next(mask, s + 1)) {
+            if (slots[s].registered) {
+                snap->entries[s] = slots[s].entry;
+            }
         }
+        snap->version = version;
+    } while (sensors_cache_read_retry(seq));
+}
+
+int sensors_cache_snapshot_get_record(const struct sensors_cache_snapshot* snap,
+                                      enum sensor s,
+                                      TickType_t now,
+                                      struct sensors_wire_record* rec)
+{
+    if (!sensors_cache_valid(s)) {
+        return -EINVAL;
+    }
+
+    sensors_cache_encode_record(s, &snap->entries[s], now, rec);
+    return 0;
+}
+
+size_t sensors_cache_get_changes(uint32_t since_boot_id,
+                                 uint32_t since,
+                                 TickType_t now,
+                                 struct sensors_wire_record* recs,
+                                 uint32_t* version_out)
+{
+    size_t cnt;
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+
+        uint32_t from =
+            since_boot_id != boot_id || since > version ? 0 : since;
+
+        cnt = 0;
+        *version_out = version;
+
+        for (int s = sensors_mask_next(&registered, 0); s >= 0;
+             s = sensors_mask_next(&registered, s + 1)) {
+            const struct sensors_cache_entry* entry = &slots[s].entry;
+            if (entry->seq > 0 && entry->changed_in > from) {
+                sensors_cache_encode_record(
+                    (enum sensor)s, entry, now, &recs[cnt++]);
+            }
+        }
+    } while (sensors_cache_read_retry(seq));
+
+    return cnt;
+}
+
+int sensors_cache_get_history(enum sensor s,
+                              uint32_t from_ms,
+                              uint32_t to_ms,
+                              struct sensors_cache_sample* samples,
+                              size_t max)
+{
+    if (!sensors_cache_registered(s)) {
+        return -EINVAL;
+    }
+
+    size_t cnt;
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+        cnt = 0;
 
-        case SENSOR_TEMP_DETECTOR: {
-            val->u16 = atomic_get(&sensor_temp_val).u16;
-            break;
+        uint32_t end = slots[s].hist_cnt;
+        uint32_t i = end > CONFIG_SENSORS_CACHE_HISTORY_LEN
+            ? end - CONFIG_SENSORS_CACHE_HISTORY_LEN
+            : 0;
+
+        for (; i < end && cnt < max; i++) {
+            const struct sensors_cache_sample* sample =
+                &history[s][i % CONFIG_SENSORS_CACHE_HISTORY_LEN];
+
+            // Uptime wraps, so compare differences
+            if ((int32_t)(sample->at_ms - from_ms) >= 0 &&
+                (int32_t)(to_ms - sample->at_ms) >= 0) {
+                samples[cnt++] = *sample;
+            }
         }
+    } while (sensors_cache_read_retry(seq));
+
+    return cnt;
+}
+
+int sensors_cache_get_windows(enum sensor s,
+                              uint32_t from_ms,
+                              struct sensors_cache_window* windows_out,
+                              size_t max)
+{
+    if (!sensors_cache_registered(s)) {
+        return -EINVAL;
+    }
+
+    const struct sensors_cache_windows* w = &windows[s];
+    uint32_t now_ms = pdTICKS_TO_MS(xTaskGetTickCount());
+    size_t cnt;
+    uint32_t seq;
+
+    do {
+        seq = sensors_cache_read_begin();
+        cnt = 0;
 
-        case SENSOR_IR_DETECTOR: {
-            val->u16 = atomic_get(&sensor_ir_detector_val).u16;
-            break;
+        uint32_t end = w->done_cnt;
+        uint32_t i = end > CONFIG_SENSORS_CACHE_AGGREGATE_WINDOWS
+            ? end - CONFIG_SENSORS_CACHE_AGGREGATE_WINDOWS
+            : 0;
+
+        for (; i < end && cnt < max; i++) {
+            const struct sensors_cache_window* win =
+                &w->done[i % CONFIG_SENSORS_CACHE_AGGREGATE_WINDOWS];
+
+            // Uptime wraps, so compare differences
+            if ((int32_t)(win->start_ms - from_ms) >= 0) {
+                windows_out[cnt++] = *win;
+            }
         }
 
-        default: {
-            return -EINVAL;
+        // No set came after the current window ended
+        const struct sensors_cache_window* cur = &w->current;
+        if (cnt < max && cur->count > 0 &&
+            (int32_t)(cur->start_ms - from_ms) >= 0 &&
+            (int32_t)(now_ms - cur->start_ms) >=
+                CONFIG_SENSORS_CACHE_AGGREGATE_WINDOW_MS) {
+            windows_out[cnt++] = *cur;
         }
+    } while (sensors_cache_read_retry(seq));
+
+    return cnt;
+}
+
+uint8_t* sensors_cache_snapshot_take(size_t* len, TickType_t* built_at)
+{
+    xSemaphoreTake(snapshot_mutex, portMAX_DELAY);
+
+    // A set found the snapshot taken
+    if (atomic_load_explicit(&snapshot_dirty, memory_order_relaxed)) {
+        sensors_cache_encode_snapshot();
     }
 
-    return 0;
+    *len = snapshot_len;
+    *built_at = snapshot_built_at;
+    return snapshot;
+}
+
+void sensors_cache_snapshot_give(void)
+{
+    xSemaphoreGive(snapshot_mutex);
 }
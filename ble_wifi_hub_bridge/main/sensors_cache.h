@@ -1,32 +1,306 @@
 #ifndef SENSORS_CACHE_H
 #define SENSORS_CACHE_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "freertos/FreeRTOS.h"
+
+#include "sensors_wire.h"
+
+/*
+ * Sensor IDs. Any ID below SENSORS_CACHE_MAX_SENSORS can be registered (see
+ * @ref sensors_cache_register); these are the ones of the demo remotes.
+ *
+ */
 enum sensor
 {
     SENSOR_MAGNETIC_FIELD,
     SENSOR_PHOTOCELL,
     SENSOR_TEMP_DETECTOR,
     SENSOR_IR_DETECTOR,
-    SENSOR_NONE
 };
 
+#define SENSORS_CACHE_MAX_SENSORS CONFIG_SENSORS_CACHE_MAX_SENSORS
+
+#define SENSORS_MASK_WORDS ((SENSORS_CACHE_MAX_SENSORS + 31) / 32)
+
+/**
+ * @brief Set of sensors, one bit per ID.
+ *
+ */
+struct sensors_mask
+{
+    uint32_t words[SENSORS_MASK_WORDS];
+};
+
+static inline void sensors_mask_set(struct sensors_mask* mask, unsigned s)
+{
+    mask->words[s / 32] |= 1UL << (s % 32);
+}
+
+static inline void sensors_mask_clear(struct sensors_mask* mask, unsigned s)
+{
+    mask->words[s / 32] &= ~(1UL << (s % 32));
+}
+
+static inline bool sensors_mask_test(const struct sensors_mask* mask,
+                                     unsigned s)
+{
+    return (mask->words[s / 32] >> (s % 32)) & 1;
+}
+
+static inline bool sensors_mask_empty(const struct sensors_mask* mask)
+{
+    for (int i = 0; i < SENSORS_MASK_WORDS; i++) {
+        if (mask->words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Get the first sensor in @p mask with an ID >= @p from, or -1 if
+ * none. Iterate with:
+ *
+ *     for (int s = sensors_mask_next(m, 0); s >= 0;
+ *          s = sensors_mask_next(m, s + 1))
+ *
+ */
+static inline int sensors_mask_next(const struct sensors_mask* mask, int from)
+{
+    for (int i = from / 32; i < SENSORS_MASK_WORDS; i++) {
+        uint32_t word = mask->words[i];
+        if (i == from / 32) {
+            word &= UINT32_MAX << (from % 32);
+        }
+        if (word) {
+            return i * 32 + __builtin_ctz(word);
+        }
+    }
+    return -1;
+}
+
 typedef union
 {
     uint16_t u16;
 } sensor_val_t;
 
+/**
+ * @brief A sensor's value and when it was stored. 16 bytes.
+ *
+ */
+struct sensors_cache_entry
+{
+    sensor_val_t val;
+    bool valid;             // Set, and its remote not lost since then
+    uint32_t seq;           // Number of times the value was set, 0 if never
+    TickType_t updated_at;  // Tick count of the last set, if seq > 0
+    uint32_t changed_in;    // Cache version when the value last changed
+};
+
+/**
+ * @brief A past value of a sensor.
+ *
+ */
+struct sensors_cache_sample
+{
+    uint32_t at_ms;         // Hub uptime when the value was set
+    uint16_t val;
+};
+
+/**
+ * @brief Aggregate of the values a sensor was set to in a window of
+ * CONFIG_SENSORS_CACHE_AGGREGATE_WINDOW_MS.
+ *
+ */
+struct sensors_cache_window
+{
+    uint64_t sum;
+    uint32_t start_ms;      // Hub uptime when the window started
+    uint32_t count;         // Number of values set in the window
+    uint16_t min;
+    uint16_t max;
+};
+
+/**
+ * @brief Sensors as they were after the same set. Indexed by sensor ID;
+ * only the entries asked for are filled.
+ *
+ */
+struct sensors_cache_snapshot
+{
+    struct sensors_cache_entry entries[SENSORS_CACHE_MAX_SENSORS];
+    uint32_t version;       // Version of the cache they were read from
+};
+
+/**
+ * @brief Initialize the cache. Must be called before any other function of
+ * this module.
+ *
+ */
+void sensors_cache_init(void);
+
+/**
+ * @brief Thread-safe. Register a sensor, so that it can be set and read, and
+ * it's part of the responses for all the sensors. Sensors are usually
+ * registered by app_main, before the tasks that use them start.
+ *
+ * @return 0 on success, -EINVAL if @p s is not below
+ * SENSORS_CACHE_MAX_SENSORS, -EEXIST if it's already registered.
+ */
+int sensors_cache_register(enum sensor s);
+
+/**
+ * @brief Thread-safe. Whether sensor @p s is registered.
+ *
+ */
+bool sensors_cache_registered(enum sensor s);
+
+/**
+ * @brief Thread-safe. Get the registered sensors.
+ *
+ * @return How many they are.
+ */
+size_t sensors_cache_get_registered(struct sensors_mask* mask);
+
 /**
  * @brief Thread-safe. Get a sensor's value.
  *
+ * All the functions that take a sensor return -EINVAL if it's not registered.
  */
 int sensors_cache_get(enum sensor s, sensor_val_t* val);
 
 /**
- * @brief Thread-safe. Set a sensor's value.
+ * @brief Thread-safe. Get a sensor's value together with its sequence number
+ * and update time.
+ *
+ */
+int sensors_cache_get_entry(enum sensor s, struct sensors_cache_entry* entry);
+
+/**
+ * @brief Thread-safe. Get a sensor's wire record (see sensors_wire.h), with
+ * its age at tick @p now.
+ *
+ */
+int sensors_cache_get_record(enum sensor s,
+                             TickType_t now,
+                             struct sensors_wire_record* rec);
+
+/**
+ * @brief Thread-safe. Get the version of the cache, which is bumped every time
+ * a sensor's value changes.
+ *
+ */
+uint32_t sensors_cache_version(void);
+
+/**
+ * @brief Thread-safe. Get the boot ID, random at every boot, which tells the
+ * versions of the cache of different boots apart.
+ *
+ */
+uint32_t sensors_cache_boot_id(void);
+
+/**
+ * @brief Thread-safe, lock-free. Get a consistent copy of the registered
+ * sensors in @p mask (all the registered ones if NULL): no set happens in
+ * between the reads of two of them. It doesn't block (nor does it disable
+ * interrupts), and it doesn't delay the sets either.
+ *
+ */
+void sensors_cache_get_snapshot(struct sensors_cache_snapshot* snap,
+                                const struct sensors_mask* mask);
+
+/**
+ * @brief Get the wire record of sensor @p s in @p snap (see
+ * @ref sensors_cache_get_record).
+ *
+ */
+int sensors_cache_snapshot_get_record(const struct sensors_cache_snapshot* snap,
+                                      enum sensor s,
+                                      TickType_t now,
+                                      struct sensors_wire_record* rec);
+
+/**
+ * @brief Thread-safe. Get the wire records, with their ages at tick @p now,
+ * of the sensors that changed after version @p since of the cache, all of
+ * them if @p since_boot_id is not the current one (the hub restarted since)
+ * or if @p since is newer than the cache.
+ *
+ * @param recs Room for a record per registered sensor.
+ * @param version Version of the cache the records were read from.
+ * @return The number of records.
+ */
+size_t sensors_cache_get_changes(uint32_t since_boot_id,
+                                 uint32_t since,
+                                 TickType_t now,
+                                 struct sensors_wire_record* recs,
+                                 uint32_t* version);
+
+/**
+ * @brief Thread-safe. Get the last CONFIG_SENSORS_CACHE_HISTORY_LEN values
+ * of a sensor at most, those set from @p from_ms to @p to_ms (hub uptime),
+ * oldest first.
+ *
+ * @param samples Room for @p max samples.
+ * @return The number of samples, or -EINVAL if the sensor is not valid.
+ */
+int sensors_cache_get_history(enum sensor s,
+                              uint32_t from_ms,
+                              uint32_t to_ms,
+                              struct sensors_cache_sample* samples,
+                              size_t max);
+
+/**
+ * @brief Thread-safe. Get the last CONFIG_SENSORS_CACHE_AGGREGATE_WINDOWS
+ * finished windows of a sensor at most, those started at or after @p from_ms
+ * (hub uptime), oldest first. Windows in which the sensor was not set are
+ * skipped.
+ *
+ * @param windows Room for @p max windows.
+ * @return The number of windows, or -EINVAL if the sensor is not valid.
+ */
+int sensors_cache_get_windows(enum sensor s,
+                              uint32_t from_ms,
+                              struct sensors_cache_window* windows,
+                              size_t max);
+
+/**
+ * @brief Thread-safe. Set a sensor's value. This also re-encodes the snapshot
+ * returned by @ref sensors_cache_snapshot_take, unless it's taken; the next
+ * take re-encodes it then. It never waits for the readers.
  *
  */
 int sensors_cache_set(enum sensor s, sensor_val_t val);
 
+/**
+ * @brief Thread-safe. Mark a sensor's value as stale, e.g. because its remote
+ * was lost. It keeps its value, sequence number and update time (so its age
+ * keeps growing) until it's set again. This bumps the version of the cache.
+ *
+ */
+int sensors_cache_invalidate(enum sensor s);
+
+/**
+ * @brief Thread-safe. Take the binary response for all the sensors (see
+ * sensors_wire.h), encoded when the cache was last set. The ages of its
+ * records are relative to @p built_at, so the caller just has to patch the
+ * `hub_ms` and `snapshot_age_ms` fields of its header before sending it.
+ *
+ * The snapshot is locked until @ref sensors_cache_snapshot_give is
+ * called; the sets go on meanwhile.
+ *
+ * @param len Length of the snapshot.
+ * @param built_at Tick count when it was encoded.
+ */
+uint8_t* sensors_cache_snapshot_take(size_t* len, TickType_t* built_at);
+
+/**
+ * @brief Give back the snapshot taken with @ref sensors_cache_snapshot_take.
+ *
+ */
+void sensors_cache_snapshot_give(void);
+
 #endif /* SENSORS_CACHE_H */
@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sensors_publisher.h"
+#include "sensors_wire.h"
+#include "log_helpers.h"
+
+static const char *TAG = "SENS_PUB";
+
+#if defined(CONFIG_SENSORS_PUBLISHER_MULTICAST)
+#define MULTICAST_ENABLED true
+#else
+#define MULTICAST_ENABLED false
+#endif
+
+#define SENSORS_PUBLISHER_TASK_STACK_SIZE 4096
+#define SENSORS_PUBLISHER_TASK_PRIORITY 5
+
+// Stay within the LAN
+#define SENSORS_PUBLISHER_MULTICAST_TTL 1
+
+#if defined(CONFIG_SENSORS_PUBLISHER)
+
+struct sensors_publisher_subscriber
+{
+    struct sockaddr_in addr;
+    struct sensors_mask sensors_mask;
+    TickType_t expires_at;
+    bool used;
+};
+
+/*
+ * Deadband and rate limit state of a sensor. Only used by the publisher task.
+ *
+ */
+struct sensors_publisher_sensor
+{
+    uint16_t last_val;
+    bool last_valid;
+    TickType_t last_at;
+    bool pushed;
+};
+
+static portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct sensors_publisher_subscriber
+    subscribers[CONFIG_SENSORS_PUBLISHER_MAX_SUBSCRIBERS] = {0};
+
+static struct sensors_publisher_sensor sensors[SENSORS_CACHE_MAX_SENSORS] = {0};
+
+// Sensors set since the task last looked, guarded by the spinlock
+static struct sensors_mask notified = {0};
+
+static TaskHandle_t publisher_task = NULL;
+
+static int publisher_sock = -1;
+
+static struct sensors_cache_snapshot snap;
+
+static uint8_t tx_buffer[SENSORS_WIRE_RESPONSE_LEN(SENSORS_CACHE_MAX_SENSORS)]
+    __attribute__((aligned(4)));
+
+static bool sensors_publisher_expired(
+    const struct sensors_publisher_subscriber* sub,
+    TickType_t now)
+{
+    return (int32_t)(now - sub->expires_at) >= 0;
+}
+
+static bool sensors_publisher_same_addr(const struct sockaddr_in* a,
+                                        const struct sockaddr_in* b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+           a->sin_port == b->sin_port;
+}
+
+/*
+ * Apply the deadband and rate limit to the sensors in @p pending.
+ *
+ * The sensors to push now are set in @p due. The ones to push later are left
+ * in @p pending and @p wait is set to the time until the first of them is
+ * due.
+ */
+static void sensors_publisher_due(struct sensors_mask* pending,
+                                  TickType_t now,
+                                  struct sensors_mask* due,
+                                  TickType_t* wait)
+{
+    memset(due, 0, sizeof(*due));
+
+    *wait = portMAX_DELAY;
+
+    for (int i = sensors_mask_next(pending, 0); i >= 0;
+         i = sensors_mask_next(pending, i + 1)) {
+        struct sensors_publisher_sensor* sens = &sensors[i];
+
+        struct sensors_cache_entry entry;
+        sensors_cache_get_entry((enum sensor)i, &entry);
+
+        // Going stale (or fresh again) is always pushed
+        if (sens->pushed && entry.valid == sens->last_valid &&
+            abs((int)entry.val.u16 - (int)sens->last_val) <
+                CONFIG_SENSORS_PUBLISHER_DEADBAND) {
+            sensors_mask_clear(pending, i);
+            continue;
+        }
+
+        TickType_t next_at = sens->last_at +
+            pdMS_TO_TICKS(CONFIG_SENSORS_PUBLISHER_MIN_INTERVAL_MS);
+
+        if (sens->pushed && (int32_t)(next_at - now) > 0) {
+            if (next_at - now < *wait) {
+                *wait = next_at - now;
+            }
+            continue;
+        }
+
+        sens->last_val = entry.val.u16;
+        sens->last_valid = entry.valid;
+        sens->last_at = now;
+        sens->pushed = true;
+
+        sensors_mask_clear(pending, i);
+        sensors_mask_set(due, i);
+    }
+}
+
+/*
+ * Encode a push of the sensors in both @p due and @p mask (all of @p due if
+ * NULL) into the tx buffer, from the snapshot taken for @p due.
+ *
+ * @return The length of the datagram, 0 if there is no sensor to push.
+ */
+static size_t sensors_publisher_encode(const struct sensors_mask* due,
+                                       const struct sensors_mask* mask,
+                                       TickType_t now)
+{
+    struct sensors_wire_header hdr = {
+        .magic = SENSORS_WIRE_MAGIC,
+        .version = SENSORS_WIRE_VERSION,
+        .type = SENSORS_WIRE_TYPE_PUSH,
+        .hub_ms = pdTICKS_TO_MS(now),
+        .cache_version = snap.version,
+        .boot_id = sensors_cache_boot_id(),
+    };
+    struct sensors_wire_record* recs =
+        (struct sensors_wire_record*)(tx_buffer + sizeof(hdr));
+
+    for (int i = sensors_mask_next(due, 0); i >= 0;
+         i = sensors_mask_next(due, i + 1)) {
+        if (mask == NULL || sensors_mask_test(mask, i)) {
+            sensors_cache_snapshot_get_record(
+                &snap, (enum sensor)i, now, &recs[hdr.count++]);
+        }
+    }
+
+    memcpy(tx_buffer, &hdr, sizeof(hdr));
+
+    return hdr.count == 0 ? 0 : SENSORS_WIRE_RESPONSE_LEN(hdr.count);
+}
+
+static void sensors_publisher_send(const struct sockaddr_in* addr, size_t len)
+{
+    int rc = sendto(publisher_sock,
+                    tx_buffer,
+                    len,
+                    0,
+                    (const struct sockaddr*)addr,
+                    sizeof(*addr));
+    if (rc < 0) {
+        LOG_ERR("push failed, error %d", errno);
+    }
+}
+
+static void sensors_publisher_push(const struct sensors_mask* due,
+                                   TickType_t now)
+{
+    // All the subscribers get the values of the same set
+    sensors_cache_get_snapshot(&snap, due);
+
+    if (MULTICAST_ENABLED) {
+        struct sockaddr_in group = {
+            .sin_family = AF_INET,
+            .sin_port = htons(CONFIG_SENSORS_PUBLISHER_MULTICAST_PORT),
+            .sin_addr.s_addr =
+                inet_addr(CONFIG_SENSORS_PUBLISHER_MULTICAST_ADDR),
+        };
+
+        size_t len = sensors_publisher_encode(due, NULL, now);
+        sensors_publisher_send(&group, len);
+        return;
+    }
+
+    struct sensors_publisher_subscriber subs[
+        CONFIG_SENSORS_PUBLISHER_MAX_SUBSCRIBERS];
+
+    portENTER_CRITICAL(&spinlock);
+    memcpy(subs, subscribers, sizeof(subs));
+    portEXIT_CRITICAL(&spinlock);
+
+    for (int i = 0; i < CONFIG_SENSORS_PUBLISHER_MAX_SUBSCRIBERS; i++) {
+        if (!subs[i].used || sensors_publisher_expired(&subs[i], now)) {
+            continue;
+        }
+
+        size_t len =
+            sensors_publisher_encode(due, &subs[i].sensors_mask, now);
+        if (len > 0) {
+            sensors_publisher_send(&subs[i].addr, len);
+        }
+    }
+}
+
+static void sensors_publisher_task(void* args)
+{
+    struct sensors_mask pending = {0};
+    struct sensors_mask due;
+    TickType_t wait = portMAX_DELAY;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        portENTER_CRITICAL(&spinlock);
+        for (int i = 0; i < SENSORS_MASK_WORDS; i++) {
+            pending.words[i] |= notified.words[i];
+            notified.words[i] = 0;
+        }
+        portEXIT_CRITICAL(&spinlock);
+
+        TickType_t now = xTaskGetTickCount();
+
+        sensors_publisher_due(&pending, now, &due, &wait);
+        if (!sensors_mask_empty(&due)) {
+            sensors_publisher_push(&due, now);
+        }
+    }
+}
+
+void sensors_publisher_setup(void)
+{
+    publisher_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (publisher_sock < 0) {
+        LOG_ERR("Unable to create socket: errno %d", errno);
+        return;
+    }
+
+    if (MULTICAST_ENABLED) {
+        uint8_t ttl = SENSORS_PUBLISHER_MULTICAST_TTL;
+        setsockopt(publisher_sock,
+                   IPPROTO_IP,
+                   IP_MULTICAST_TTL,
+                   &ttl,
+                   sizeof(ttl));
+    }
+
+    BaseType_t rc = xTaskCreate(sensors_publisher_task,
+                                "sens_pub",
+                                SENSORS_PUBLISHER_TASK_STACK_SIZE,
+                                NULL,
+                                SENSORS_PUBLISHER_TASK_PRIORITY,
+                                &publisher_task);
+    if (rc != pdPASS) {
+        LOG_ERR("could not create the publisher task");
+    }
+}
+
+int sensors_publisher_subscribe(const struct sockaddr_in* addr,
+                                const struct sensors_mask* sensors_mask)
+{
+    TickType_t now = xTaskGetTickCount();
+    int slot = -1;
+
+    portENTER_CRITICAL(&spinlock);
+
+    for (int i = 0; i < CONFIG_SENSORS_PUBLISHER_MAX_SUBSCRIBERS; i++) {
+        struct sensors_publisher_subscriber* sub = &subscribers[i];
+
+        if (sub->used && sensors_publisher_same_addr(&sub->addr, addr)) {
+            slot = i;
+            break;
+        }
+
+        if (slot < 0 && (!sub->used || sensors_publisher_expired(sub, now))) {
+            slot = i;
+        }
+    }
+
+    if (slot >= 0) {
+        subscribers[slot].addr = *addr;
+        subscribers[slot].sensors_mask = *sensors_mask;
+        subscribers[slot].expires_at =
+            now + pdMS_TO_TICKS(CONFIG_SENSORS_PUBLISHER_LEASE_MS);
+        subscribers[slot].used = true;
+    }
+
+    portEXIT_CRITICAL(&spinlock);
+
+    return slot < 0 ? -ENOMEM : 0;
+}
+
+void sensors_publisher_notify(enum sensor s)
+{
+    if (publisher_task == NULL || (unsigned)s >= SENSORS_CACHE_MAX_SENSORS) {
+        return;
+    }
+
+    portENTER_CRITICAL(&spinlock);
+    sensors_mask_set(&notified, s);
+    portEXIT_CRITICAL(&spinlock);
+
+    xTaskNotifyGive(publisher_task);
+}
+
+#else
+
+void sensors_publisher_setup(void)
+{
+}
+
+int sensors_publisher_subscribe(const struct sockaddr_in* addr,
+                                const struct sensors_mask* sensors_mask)
+{
+    return -ENOTSUP;
+}
+
+void sensors_publisher_notify(enum sensor s)
+{
+}
+
+#endif
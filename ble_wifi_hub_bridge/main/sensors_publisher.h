@@ -0,0 +1,47 @@
+/**
+ * @brief Pushes the sensor samples stored in the sensors cache to the
+ * subscribed clients, and optionally to a multicast group, as binary
+ * datagrams (see sensors_wire.h) of type SENSORS_WIRE_TYPE_PUSH.
+ *
+ * Clients subscribe through the UDP sensor server and must renew their
+ * subscription before CONFIG_SENSORS_PUBLISHER_LEASE_MS. A sample is not
+ * pushed if it's within CONFIG_SENSORS_PUBLISHER_DEADBAND of the last pushed
+ * value of its sensor, and each sensor is pushed at most once per
+ * CONFIG_SENSORS_PUBLISHER_MIN_INTERVAL_MS (the last sample is pushed when
+ * the interval elapses).
+ *
+ */
+
+#ifndef SENSORS_PUBLISHER_H
+#define SENSORS_PUBLISHER_H
+
+#include <stdint.h>
+
+#include <lwip/sockets.h>
+
+#include "sensors_cache.h"
+
+/**
+ * @brief Start the publisher task. Requires the network to be up.
+ *
+ */
+void sensors_publisher_setup(void);
+
+/**
+ * @brief Thread-safe. Subscribe the client at @p addr to the sensors in
+ * @p sensors_mask, or renew its subscription.
+ *
+ * @return 0 on success, -ENOMEM if there are too many subscribers or
+ * -ENOTSUP if the publisher is disabled.
+ */
+int sensors_publisher_subscribe(const struct sockaddr_in* addr,
+                                const struct sensors_mask* sensors_mask);
+
+/**
+ * @brief Thread-safe. Notify the publisher that sensor @p s was set in the
+ * cache.
+ *
+ */
+void sensors_publisher_notify(enum sensor s);
+
+#endif /* SENSORS_PUBLISHER_H */
@@ -0,0 +1,176 @@
+/**
+ * @brief Binary protocol of the UDP sensor server. It lives alongside the
+ * ASCII one: a datagram starting with @ref SENSORS_WIRE_MAGIC is a binary
+ * request.
+ *
+ * All the fields are little-endian. A request is a header followed by
+ * `count` 16-bit sensor IDs (`count` = 0 requests all the sensors). A
+ * response is a header followed by `count` records. The responses for all the
+ * sensors are sent from a pre-encoded snapshot: the age of a record is then
+ * its `age_ms` plus the `snapshot_age_ms` of the header. A record with
+ * SENSORS_WIRE_RECORD_FLAG_STALE set holds the last value read from a remote
+ * that was lost since then (or no value at all), and shouldn't be displayed
+ * as current.
+ *
+ * Every response carries the version of the cache its records were read
+ * from, and the boot ID of the hub, which is random at every boot (versions
+ * start over then). A delta request carries the last version and boot ID seen
+ * by the client instead of IDs, and gets either a "not modified" header or
+ * the records of the sensors that changed since then; all of them if the boot
+ * ID doesn't match, or if the version is newer than the cache's.
+ *
+ * A subscribe request lists IDs like a request, and is answered like one; the
+ * new samples of those sensors are then pushed to the client (see
+ * sensors_publisher.h).
+ *
+ * A request with SENSORS_WIRE_FLAG_MAX_AGE set is not answered until all its
+ * sensors are at most `max_age_ms` old (they are read on demand), or until a
+ * deadline passes; the ages of the records tell which case it was.
+ *
+ * A history request asks for the values a sensor took in a range of hub
+ * uptime. The response (`count` samples) is the sensor ID followed by the
+ * samples, oldest first, as pairs of varints (LEB128): the time in ms and
+ * value of the first one, then the time delta and the zigzag-encoded value
+ * delta of each of the rest. If they don't fit in a datagram, the response has
+ * SENSORS_WIRE_FLAG_TRUNCATED set and the client can ask for the rest.
+ *
+ * A windows request lists IDs like a request, and asks for the aggregates of
+ * those sensors over the finished windows that started at or after its
+ * `from_ms` (hub uptime). The response is `count` windows, grouped by sensor
+ * and oldest first. The windows of a sensor are never split: if they don't
+ * all fit in a datagram, the response has SENSORS_WIRE_FLAG_TRUNCATED set and
+ * the client can ask again for the sensors after the last one it got.
+ *
+ */
+
+#ifndef SENSORS_WIRE_H
+#define SENSORS_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SENSORS_WIRE_MAGIC 0xB5E5
+#define SENSORS_WIRE_VERSION 5
+
+// Age of a sensor that was never read
+#define SENSORS_WIRE_AGE_UNKNOWN UINT32_MAX
+
+// The structs below are sent as they are.
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+               "the wire format is little-endian");
+
+enum sensors_wire_type
+{
+    SENSORS_WIRE_TYPE_REQUEST = 1,
+    SENSORS_WIRE_TYPE_RESPONSE = 2,
+    SENSORS_WIRE_TYPE_ERROR = 3,
+    SENSORS_WIRE_TYPE_DELTA_REQUEST = 4,
+    SENSORS_WIRE_TYPE_NOT_MODIFIED = 5,
+    SENSORS_WIRE_TYPE_SUBSCRIBE = 6,
+    SENSORS_WIRE_TYPE_PUSH = 7,
+    SENSORS_WIRE_TYPE_HISTORY_REQUEST = 8,
+    SENSORS_WIRE_TYPE_HISTORY = 9,
+    SENSORS_WIRE_TYPE_WINDOWS_REQUEST = 10,
+    SENSORS_WIRE_TYPE_WINDOWS = 11,
+};
+
+// Header flags
+#define SENSORS_WIRE_FLAG_TRUNCATED (1 << 0)
+#define SENSORS_WIRE_FLAG_MAX_AGE (1 << 1)
+
+// Record flags
+#define SENSORS_WIRE_RECORD_FLAG_STALE (1 << 0)
+
+struct sensors_wire_header
+{
+    uint16_t magic;           // SENSORS_WIRE_MAGIC
+    uint8_t version;          // SENSORS_WIRE_VERSION
+    uint8_t type;             // enum sensors_wire_type
+    uint16_t count;           // Number of IDs or records that follow
+    uint16_t flags;
+    uint32_t hub_ms;          // Hub uptime when the datagram was sent
+    union {
+        uint32_t snapshot_age_ms; // To be added to the ages of the records
+        uint32_t max_age_ms;      // Of the values requested, see below
+        uint32_t from_ms;         // Of the windows requested, see below
+    };
+    uint32_t cache_version;   // Of the records, or last seen in delta requests
+    uint32_t boot_id;         // Of the hub, or last seen in delta requests
+} __attribute__((packed));
+
+struct sensors_wire_record
+{
+    uint16_t id;
+    uint16_t value;
+    uint32_t seq;             // Number of samples, 0 if none
+    uint32_t age_ms;          // SENSORS_WIRE_AGE_UNKNOWN if never read
+    uint16_t flags;
+    uint16_t reserved;
+} __attribute__((packed));
+
+/*
+ * Follows the header of a history request.
+ *
+ */
+struct sensors_wire_history_request
+{
+    uint16_t id;
+    uint32_t from_ms;
+    uint32_t to_ms;
+} __attribute__((packed));
+
+/*
+ * Aggregate of a sensor over a window, in windows responses.
+ *
+ */
+struct sensors_wire_window
+{
+    uint16_t id;
+    uint16_t min;
+    uint16_t max;
+    uint16_t mean;            // Rounded to the nearest
+    uint32_t start_ms;        // Hub uptime when the window started
+    uint32_t len_ms;          // Length of the window
+    uint32_t count;           // Number of values set in the window
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct sensors_wire_header) == 24, "wire header size");
+_Static_assert(sizeof(struct sensors_wire_record) == 16, "wire record size");
+_Static_assert(sizeof(struct sensors_wire_window) == 20, "wire window size");
+
+#define SENSORS_WIRE_RESPONSE_LEN(records)                                   \
+    (sizeof(struct sensors_wire_header) +                                    \
+     (records) * sizeof(struct sensors_wire_record))
+
+// Max. length of a 32-bit varint
+#define SENSORS_WIRE_VARINT_MAX_LEN 5
+
+/**
+ * @brief Encode @p val as a varint at @p buf.
+ *
+ * @return The number of bytes written.
+ */
+static inline size_t sensors_wire_put_varint(uint8_t* buf, uint32_t val)
+{
+    size_t len = 0;
+
+    while (val >= 0x80) {
+        buf[len++] = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+    buf[len++] = (uint8_t)val;
+
+    return len;
+}
+
+/**
+ * @brief Map a signed delta to an unsigned one, so that small deltas of
+ * either sign are encoded in few bytes.
+ *
+ */
+static inline uint32_t sensors_wire_zigzag(int32_t val)
+{
+    return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
+
+#endif /* SENSORS_WIRE_H */
@@ -0,0 +1,68 @@
+#include <assert.h>
+
+#include "spsc_ring.h"
+
+void spsc_ring_init(struct spsc_ring* ring,
+                    void* buf,
+                    size_t elem_size,
+                    size_t capacity)
+{
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+    ring->buf = buf;
+    ring->elem_size = elem_size;
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+/*
+ * The head and tail grow freely and are masked on access, so a full ring
+ * (head - tail == capacity) can be told apart from an empty one.
+ *
+ */
+void* spsc_ring_reserve(struct spsc_ring* ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == ring->capacity) {
+        return NULL;
+    }
+
+    return ring->buf + (head & (ring->capacity - 1)) * ring->elem_size;
+}
+
+void spsc_ring_commit(struct spsc_ring* ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    // Release: the slot contents must be visible before the new head.
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void* spsc_ring_peek(struct spsc_ring* ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    return ring->buf + (tail & (ring->capacity - 1)) * ring->elem_size;
+}
+
+void spsc_ring_release(struct spsc_ring* ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    // Release: the slot must be done with before the producer reuses it.
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+size_t spsc_ring_count(struct spsc_ring* ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
@@ -0,0 +1,71 @@
+/**
+ * @brief Lock-free single-producer single-consumer ring of fixed size
+ * elements. The producer reserves a slot, fills it in place and commits it;
+ * the consumer peeks the oldest slot and releases it once done with it. Only
+ * the producer writes the head and only the consumer writes the tail, so no
+ * locks are needed.
+ *
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct spsc_ring
+{
+    uint8_t* buf;
+    size_t elem_size;
+    size_t capacity;
+    atomic_size_t head;
+    atomic_size_t tail;
+};
+
+/**
+ * @brief Initialize the ring over @p buf, which must hold @p capacity elements
+ * of @p elem_size bytes. @p capacity must be a power of two.
+ *
+ */
+void spsc_ring_init(struct spsc_ring* ring,
+                    void* buf,
+                    size_t elem_size,
+                    size_t capacity);
+
+/**
+ * @brief Producer. Get the next free slot, or NULL if the ring is full.
+ *
+ */
+void* spsc_ring_reserve(struct spsc_ring* ring);
+
+/**
+ * @brief Producer. Make the slot got from @ref spsc_ring_reserve available to
+ * the consumer.
+ *
+ */
+void spsc_ring_commit(struct spsc_ring* ring);
+
+/**
+ * @brief Consumer. Get the oldest committed slot, or NULL if the ring is
+ * empty.
+ *
+ */
+void* spsc_ring_peek(struct spsc_ring* ring);
+
+/**
+ * @brief Consumer. Give the slot got from @ref spsc_ring_peek back to the
+ * producer.
+ *
+ */
+void spsc_ring_release(struct spsc_ring* ring);
+
+/**
+ * @brief Number of committed slots. Exact only from the producer or the
+ * consumer.
+ *
+ */
+size_t spsc_ring_count(struct spsc_ring* ring);
+
+#endif /* SPSC_RING_H */
@@ -7,6 +7,8 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
 
 #include <sys/param.h>
@@ -22,10 +24,42 @@
 
 #include "udp_sensor_server.h"
 #include "sensors_cache.h"
+#include "sensors_wire.h"
+#include "sensors_publisher.h"
 #include "log_helpers.h"
 
 static const char *TAG = "UDP_SRVR";
 
+#define UDP_SENSOR_SERVER_TASK_STACK_SIZE 4096
+#define UDP_SENSOR_SERVER_TASK_PRIORITY 5
+
+// How often parked requests are checked for fresh values
+#define UDP_SENSOR_SERVER_PARKED_POLL_MS 20
+
+// How long to wait before creating the socket again after an error
+#define UDP_SENSOR_SERVER_RETRY_MS 1000
+
+#if defined(CONFIG_UDP_SENSOR_SERVER_ALWAYS_ON)
+#define ALWAYS_ON_ENABLED true
+#else
+#define ALWAYS_ON_ENABLED false
+#endif
+
+#if defined(CONFIG_UDP_SENSOR_SERVER_ADAPTIVE_WINDOW)
+#define ADAPTIVE_WINDOW_ENABLED true
+#define MIN_WINDOW_MS CONFIG_UDP_SENSOR_SERVER_MIN_WINDOW_MS
+#define IDLE_MS CONFIG_UDP_SENSOR_SERVER_IDLE_MS
+#define WINDOW_HALF_RATE CONFIG_UDP_SENSOR_SERVER_WINDOW_HALF_RATE
+#else
+#define ADAPTIVE_WINDOW_ENABLED false
+#define MIN_WINDOW_MS 0
+#define IDLE_MS 0
+#define WINDOW_HALF_RATE 1
+#endif
+
+// Weight of the last window in the request rate moving average: 1 / 2^N
+#define UDP_SENSOR_SERVER_RATE_EWMA_SHIFT 2
+
 static struct timeval udp_sensor_server_get_timeval(uint32_t timeout_ms)
 {
     struct timeval timeout = {0};
@@ -34,21 +68,26 @@ static struct timeval udp_sensor_server_get_timeval(uint32_t timeout_ms)
     return timeout;
 }
 
-static void udp_sensor_server_set_timeout(struct udp_sensor_server* udp_srvr,
-                                          uint32_t timeout_ms)
+/*
+ * Close a socket that couldn't be set up, keeping the errno of the failure
+ * for the caller to report.
+ *
+ */
+static void udp_sensor_server_discard_socket(struct udp_sensor_server* udp_srvr)
 {
-    struct timeval timeout = udp_sensor_server_get_timeval(timeout_ms);
-
-    LOG_DBG("configuring UDP socket with timeout = %lld sec and %ld us",
-            timeout.tv_sec,
-            timeout.tv_usec);
-
-    setsockopt(
-        udp_srvr->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int err = errno;
+    close(udp_srvr->sock);
+    udp_srvr->sock = -1;
+    errno = err;
 }
 
-static int udp_sensor_server_get_socket(struct udp_sensor_server* udp_srvr,
-                                        uint32_t timeout_ms)
+/*
+ * The socket is non-blocking: select() waits for requests, and then all the
+ * pending ones are read until recvfrom() would block. If it can't be set up,
+ * it's closed, so that retries don't leak it.
+ *
+ */
+static int udp_sensor_server_get_socket(struct udp_sensor_server* udp_srvr)
 {
     udp_srvr->sever_sock_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     udp_srvr->sever_sock_addr.sin_family = AF_INET;
@@ -60,19 +99,24 @@ static int udp_sensor_server_get_socket(struct udp_sensor_server* udp_srvr,
         return udp_srvr->sock;
     }
 
-    udp_sensor_server_set_timeout(udp_srvr, timeout_ms);
+    int flags = fcntl(udp_srvr->sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(udp_srvr->sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        udp_sensor_server_discard_socket(udp_srvr);
+        return -1;
+    }
 
     int err = bind(udp_srvr->sock,
                    (struct sockaddr *)&udp_srvr->sever_sock_addr,
                    sizeof(udp_srvr->sever_sock_addr));
     if (err < 0) {
+        udp_sensor_server_discard_socket(udp_srvr);
         return err;
     }
 
     return udp_srvr->sock;
 }
 
-static int udp_sensor_server_wait_for_request(struct udp_sensor_server* udp_srvr)
+static int udp_sensor_server_read_request(struct udp_sensor_server* udp_srvr)
 {
     socklen_t socklen = sizeof(udp_srvr->client_sock_addr);
 
@@ -87,37 +131,860 @@ static int udp_sensor_server_wait_for_request(struct udp_sensor_server* udp_srvr
     }
 
     udp_srvr->rx_buffer[recv_bytes] = '\0';
+    udp_srvr->rx_len = recv_bytes;
     return recv_bytes;
 }
 
+/*
+ * Parse a batch request: "*" (all the sensors) or a comma separated list of
+ * IDs and ranges of IDs, e.g. "0,2" or "1-3". Whitespace is ignored. Listed
+ * IDs must be registered; ranges just skip the IDs that aren't.
+ *
+ * @return 0 and the requested IDs in @p ids on success, -EINVAL otherwise.
+ */
+static int udp_sensor_server_parse_ids(const char* req,
+                                       struct sensors_mask* ids)
+{
+    memset(ids, 0, sizeof(*ids));
+
+    while (isspace((unsigned char)*req)) {
+        req++;
+    }
+
+    if (*req == '*') {
+        sensors_cache_get_registered(ids);
+        req++;
+    } else {
+        for (;;) {
+            char* end;
+
+            unsigned long first = strtoul(req, &end, 10);
+            if (end == req) {
+                return -EINVAL;
+            }
+
+            unsigned long last = first;
+            req = end;
+            if (*req == '-') {
+                req++;
+                last = strtoul(req, &end, 10);
+                if (end == req) {
+                    return -EINVAL;
+                }
+                req = end;
+            }
+
+            if (first > last || last >= SENSORS_CACHE_MAX_SENSORS ||
+                (first == last && !sensors_cache_registered(first))) {
+                return -EINVAL;
+            }
+
+            for (unsigned long id = first; id <= last; id++) {
+                if (sensors_cache_registered(id)) {
+                    sensors_mask_set(ids, id);
+                }
+            }
+
+            if (*req != ',') {
+                break;
+            }
+            req++;
+        }
+    }
+
+    while (isspace((unsigned char)*req)) {
+        req++;
+    }
+
+    return *req == '\0' ? 0 : -EINVAL;
+}
+
+static bool udp_sensor_server_is_batch_request(const char* req)
+{
+    return req[0] == '*' || strchr(req, ',') != NULL ||
+           strchr(req, '-') != NULL;
+}
+
+/*
+ * Format the batch response line of sensor @p s from the snapshot taken at
+ * @p now: "<id>=<value> age_ms=<age>", the age being "unknown" if the sensor
+ * was never read, and " stale" appended if its remote was lost since.
+ *
+ */
+static int udp_sensor_server_format_line(struct udp_sensor_server* udp_srvr,
+                                         size_t len,
+                                         int s,
+                                         TickType_t now)
+{
+    const struct sensors_cache_entry* entry = &udp_srvr->snap.entries[s];
+    char* buf = udp_srvr->tx_buffer + len;
+    size_t size = sizeof(udp_srvr->tx_buffer) - len;
+
+    if (entry->seq == 0) {
+        return snprintf(buf, size, "%d=%d age_ms=unknown stale\n",
+                        s, entry->val.u16);
+    }
+
+    return snprintf(buf,
+                    size,
+                    "%d=%d age_ms=%lu%s\n",
+                    s,
+                    entry->val.u16,
+                    (unsigned long)pdTICKS_TO_MS(now - entry->updated_at),
+                    entry->valid ? "" : " stale");
+}
+
+/*
+ * Answer a batch request with one "<id>=<value> age_ms=<age>" line per
+ * requested sensor, all in the same datagram, or with "error=invalid_request"
+ * if the request can't be parsed.
+ *
+ */
+static int udp_sensor_server_handle_batch_request(
+    struct udp_sensor_server* udp_srvr)
+{
+    struct sensors_mask ids;
+    size_t len = 0;
+
+    if (udp_sensor_server_parse_ids(udp_srvr->rx_buffer, &ids) < 0) {
+        LOG_ERR("Invalid request %s", udp_srvr->rx_buffer);
+        len = snprintf(udp_srvr->tx_buffer,
+                       sizeof(udp_srvr->tx_buffer),
+                       "error=invalid_request\n");
+        memset(&ids, 0, sizeof(ids));
+    }
+
+    // All the values from the same cycle
+    sensors_cache_get_snapshot(&udp_srvr->snap, &ids);
+
+    TickType_t now = xTaskGetTickCount();
+
+    for (int i = sensors_mask_next(&ids, 0); i >= 0;
+         i = sensors_mask_next(&ids, i + 1)) {
+        int n = udp_sensor_server_format_line(udp_srvr, len, i, now);
+        if (n < 0 || (size_t)n >= sizeof(udp_srvr->tx_buffer) - len) {
+            LOG_ERR("Response truncated at sensor %d", i);
+            break;
+        }
+        len += n;
+    }
+
+    return sendto(udp_srvr->sock,
+                  udp_srvr->tx_buffer,
+                  len,
+                  0,
+                  &udp_srvr->client_sock_addr,
+                  sizeof(udp_srvr->client_sock_addr));
+}
+
+_Static_assert(sizeof(((struct udp_sensor_server*)0)->tx_buffer) >=
+                   SENSORS_WIRE_RESPONSE_LEN(SENSORS_CACHE_MAX_SENSORS),
+               "tx buffer too small for a binary response");
+
+static bool udp_sensor_server_is_binary_request(
+    const struct udp_sensor_server* udp_srvr)
+{
+    uint16_t magic;
+
+    if (udp_srvr->rx_len < sizeof(magic)) {
+        return false;
+    }
+
+    memcpy(&magic, udp_srvr->rx_buffer, sizeof(magic));
+    return magic == SENSORS_WIRE_MAGIC;
+}
+
+/*
+ * Send the snapshot of all the sensors kept by the cache, just patching the
+ * time fields of its header.
+ *
+ */
+static int udp_sensor_server_send_snapshot(struct udp_sensor_server* udp_srvr,
+                                           TickType_t now)
+{
+    size_t len;
+    TickType_t built_at;
+    uint8_t* snapshot = sensors_cache_snapshot_take(&len, &built_at);
+
+    struct sensors_wire_header* hdr = (struct sensors_wire_header*)snapshot;
+    hdr->hub_ms = pdTICKS_TO_MS(now);
+    hdr->snapshot_age_ms = pdTICKS_TO_MS(now - built_at);
+
+    int rc = sendto(udp_srvr->sock,
+                    snapshot,
+                    len,
+                    0,
+                    &udp_srvr->client_sock_addr,
+                    sizeof(udp_srvr->client_sock_addr));
+
+    sensors_cache_snapshot_give();
+    return rc;
+}
+
+/*
+ * Get the sensors listed in the request, all the registered ones if none.
+ *
+ */
+static int udp_sensor_server_ids_mask(struct udp_sensor_server* udp_srvr,
+                                      const struct sensors_wire_header* req,
+                                      struct sensors_mask* mask)
+{
+    const uint8_t* ids = (const uint8_t*)udp_srvr->rx_buffer + sizeof(*req);
+
+    if (req->count == 0) {
+        sensors_cache_get_registered(mask);
+        return 0;
+    }
+
+    memset(mask, 0, sizeof(*mask));
+
+    for (size_t i = 0; i < req->count; i++) {
+        uint16_t id;
+        memcpy(&id, ids + i * sizeof(id), sizeof(id));
+
+        if (!sensors_cache_registered(id)) {
+            LOG_ERR("Invalid sensor ID %u", id);
+            return -EINVAL;
+        }
+        sensors_mask_set(mask, id);
+    }
+
+    return 0;
+}
+
+/*
+ * Fill @p resp and the records that follow it in the tx buffer with the
+ * sensors listed in the request, or make it an error if any is unknown.
+ *
+ */
+static void udp_sensor_server_read_ids(struct udp_sensor_server* udp_srvr,
+                                       const struct sensors_wire_header* req,
+                                       TickType_t now,
+                                       struct sensors_wire_header* resp)
+{
+    const uint8_t* ids = (const uint8_t*)udp_srvr->rx_buffer + sizeof(*req);
+    struct sensors_wire_record* recs =
+        (struct sensors_wire_record*)(udp_srvr->tx_buffer + sizeof(*resp));
+    struct sensors_mask mask;
+
+    if (udp_sensor_server_ids_mask(udp_srvr, req, &mask) < 0 ||
+        req->count > SENSORS_CACHE_MAX_SENSORS) {
+        resp->type = SENSORS_WIRE_TYPE_ERROR;
+        return;
+    }
+
+    sensors_cache_get_snapshot(&udp_srvr->snap, &mask);
+
+    resp->cache_version = udp_srvr->snap.version;
+
+    // In the order they were asked for
+    for (size_t i = 0; i < req->count; i++) {
+        uint16_t id;
+        memcpy(&id, ids + i * sizeof(id), sizeof(id));
+
+        sensors_cache_snapshot_get_record(
+            &udp_srvr->snap, (enum sensor)id, now, &recs[resp->count++]);
+    }
+}
+
+/*
+ * Subscribe the client to the sensors listed in the request, all of them if
+ * none.
+ *
+ */
+static int udp_sensor_server_subscribe(struct udp_sensor_server* udp_srvr,
+                                       const struct sensors_wire_header* req)
+{
+    struct sensors_mask mask;
+
+    int rc = udp_sensor_server_ids_mask(udp_srvr, req, &mask);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = sensors_publisher_subscribe(
+        (const struct sockaddr_in*)&udp_srvr->client_sock_addr, &mask);
+    if (rc < 0) {
+        LOG_ERR("Could not subscribe client, error %d", rc);
+    }
+
+    return rc;
+}
+
+/*
+ * Whether all the sensors in @p mask are at most @p max_age_ms old. Those
+ * that aren't are set in @p stale.
+ *
+ */
+static bool udp_sensor_server_fresh(const struct sensors_mask* mask,
+                                    uint32_t max_age_ms,
+                                    TickType_t now,
+                                    struct sensors_mask* stale)
+{
+    memset(stale, 0, sizeof(*stale));
+
+    for (int i = sensors_mask_next(mask, 0); i >= 0;
+         i = sensors_mask_next(mask, i + 1)) {
+        struct sensors_cache_entry entry;
+        sensors_cache_get_entry((enum sensor)i, &entry);
+
+        if (entry.seq == 0 ||
+            pdTICKS_TO_MS(now - entry.updated_at) > max_age_ms) {
+            sensors_mask_set(stale, i);
+        }
+    }
+
+    return sensors_mask_empty(stale);
+}
+
+/*
+ * Hand the refresh failures reported so far to the requests parked by then;
+ * a request parked later waits for the refreshes it asked for itself.
+ *
+ */
+static void udp_sensor_server_collect_failed(struct udp_sensor_server* udp_srvr)
+{
+    struct sensors_mask failed;
+
+    for (int i = 0; i < SENSORS_MASK_WORDS; i++) {
+        failed.words[i] = atomic_exchange(&udp_srvr->refresh_failed[i], 0);
+    }
+
+    for (int i = 0; i < UDP_SENSOR_SERVER_MAX_PARKED; i++) {
+        struct udp_sensor_server_parked_req* parked = &udp_srvr->parked[i];
+        if (!parked->used) {
+            continue;
+        }
+
+        for (int w = 0; w < SENSORS_MASK_WORDS; w++) {
+            parked->failed.words[w] |= failed.words[w];
+        }
+    }
+}
+
+/*
+ * Park a request whose sensors are older than its max. age, and ask for them
+ * to be refreshed. Requests for the same sensors share the refresh, as the
+ * connection manager reads each remote once however many times it's
+ * expedited.
+ *
+ * @return Whether the request was parked; if not, it must be answered now.
+ */
+static bool udp_sensor_server_park(struct udp_sensor_server* udp_srvr,
+                                   const struct sensors_wire_header* req,
+                                   TickType_t now)
+{
+    struct sensors_mask mask;
+    struct sensors_mask stale;
+
+    if (!ALWAYS_ON_ENABLED || udp_srvr->refresh_functor == NULL ||
+        udp_sensor_server_ids_mask(udp_srvr, req, &mask) < 0 ||
+        udp_sensor_server_fresh(&mask, req->max_age_ms, now, &stale)) {
+        return false;
+    }
+
+    udp_sensor_server_collect_failed(udp_srvr);
+
+    struct udp_sensor_server_parked_req* parked = NULL;
+    for (int i = 0; i < UDP_SENSOR_SERVER_MAX_PARKED; i++) {
+        if (!udp_srvr->parked[i].used) {
+            parked = &udp_srvr->parked[i];
+            break;
+        }
+    }
+
+    if (parked == NULL) {
+        LOG_WRN("Too many parked requests, answering with stale values");
+        return false;
+    }
+
+    parked->client_sock_addr = udp_srvr->client_sock_addr;
+    parked->sensors_mask = mask;
+    parked->max_age_ms = req->max_age_ms;
+    parked->deadline =
+        now + pdMS_TO_TICKS(CONFIG_UDP_SENSOR_SERVER_READ_THROUGH_TIMEOUT_MS);
+    memset(&parked->failed, 0, sizeof(parked->failed));
+    parked->used = true;
+    udp_srvr->parked_cnt++;
+
+    for (int i = sensors_mask_next(&stale, 0); i >= 0;
+         i = sensors_mask_next(&stale, i + 1)) {
+        udp_srvr->refresh_functor->handler(
+            (enum sensor)i, udp_srvr->refresh_functor->user_args);
+    }
+
+    return true;
+}
+
+/*
+ * Whether every sensor in @p stale failed to be refreshed.
+ *
+ */
+static bool udp_sensor_server_all_failed(const struct sensors_mask* stale,
+                                         const struct sensors_mask* failed)
+{
+    for (int i = 0; i < SENSORS_MASK_WORDS; i++) {
+        if (stale->words[i] & ~failed->words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Answer the parked requests whose sensors are fresh now, whose stale sensors
+ * all failed to be refreshed, or whose deadline passed (with the values there
+ * are, ages included).
+ *
+ */
+static void udp_sensor_server_serve_parked(struct udp_sensor_server* udp_srvr)
+{
+    TickType_t now = xTaskGetTickCount();
+
+    udp_sensor_server_collect_failed(udp_srvr);
+
+    for (int i = 0; i < UDP_SENSOR_SERVER_MAX_PARKED; i++) {
+        struct udp_sensor_server_parked_req* parked = &udp_srvr->parked[i];
+        struct sensors_mask stale;
+
+        if (!parked->used) {
+            continue;
+        }
+
+        if (!udp_sensor_server_fresh(
+                &parked->sensors_mask, parked->max_age_ms, now, &stale) &&
+            !udp_sensor_server_all_failed(&stale, &parked->failed) &&
+            (int32_t)(now - parked->deadline) < 0) {
+            continue;
+        }
+
+        struct sensors_cache_snapshot* snap = &udp_srvr->snap;
+        sensors_cache_get_snapshot(snap, &parked->sensors_mask);
+
+        struct sensors_wire_header resp = {
+            .magic = SENSORS_WIRE_MAGIC,
+            .version = SENSORS_WIRE_VERSION,
+            .type = SENSORS_WIRE_TYPE_RESPONSE,
+            .hub_ms = pdTICKS_TO_MS(now),
+            .cache_version = snap->version,
+            .boot_id = sensors_cache_boot_id(),
+        };
+        struct sensors_wire_record* recs =
+            (struct sensors_wire_record*)(udp_srvr->tx_buffer + sizeof(resp));
+
+        for (int id = sensors_mask_next(&parked->sensors_mask, 0); id >= 0;
+             id = sensors_mask_next(&parked->sensors_mask, id + 1)) {
+            sensors_cache_snapshot_get_record(
+                snap, (enum sensor)id, now, &recs[resp.count++]);
+        }
+
+        memcpy(udp_srvr->tx_buffer, &resp, sizeof(resp));
+
+        int rc = sendto(udp_srvr->sock,
+                        udp_srvr->tx_buffer,
+                        SENSORS_WIRE_RESPONSE_LEN(resp.count),
+                        0,
+                        &parked->client_sock_addr,
+                        sizeof(parked->client_sock_addr));
+        if (rc < 0) {
+            LOG_ERR("Error occurred during sending: errno %d", errno);
+        }
+
+        parked->used = false;
+        udp_srvr->parked_cnt--;
+    }
+}
+
+/*
+ * Answer a history request with the samples of the sensor in the requested
+ * range, as many as fit in the tx buffer.
+ *
+ */
+static int udp_sensor_server_send_history(struct udp_sensor_server* udp_srvr,
+                                          struct sensors_wire_header* resp)
+{
+    struct sensors_wire_history_request req;
+    memcpy(&req,
+           udp_srvr->rx_buffer + sizeof(struct sensors_wire_header),
+           sizeof(req));
+
+    // Too big for the task stack
+    struct sensors_cache_sample* samples = udp_srvr->history;
+
+    int cnt = sensors_cache_get_history((enum sensor)req.id,
+                                        req.from_ms,
+                                        req.to_ms,
+                                        samples,
+                                        CONFIG_SENSORS_CACHE_HISTORY_LEN);
+    if (cnt < 0) {
+        LOG_ERR("Invalid sensor ID %u", req.id);
+        resp->type = SENSORS_WIRE_TYPE_ERROR;
+        cnt = 0;
+    } else {
+        resp->type = SENSORS_WIRE_TYPE_HISTORY;
+    }
+
+    uint8_t* buf = (uint8_t*)udp_srvr->tx_buffer;
+    size_t len = sizeof(*resp);
+
+    if (resp->type == SENSORS_WIRE_TYPE_HISTORY) {
+        memcpy(buf + len, &req.id, sizeof(req.id));
+        len += sizeof(req.id);
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        if (len + 2 * SENSORS_WIRE_VARINT_MAX_LEN >
+            sizeof(udp_srvr->tx_buffer)) {
+            resp->flags |= SENSORS_WIRE_FLAG_TRUNCATED;
+            break;
+        }
+
+        if (i == 0) {
+            len += sensors_wire_put_varint(buf + len, samples[i].at_ms);
+            len += sensors_wire_put_varint(buf + len, samples[i].val);
+        } else {
+            len += sensors_wire_put_varint(
+                buf + len, samples[i].at_ms - samples[i - 1].at_ms);
+            len += sensors_wire_put_varint(
+                buf + len,
+                sensors_wire_zigzag((int32_t)samples[i].val -
+                                    (int32_t)samples[i - 1].val));
+        }
+
+        resp->count++;
+    }
+
+    memcpy(buf, resp, sizeof(*resp));
+
+    return sendto(udp_srvr->sock,
+                  buf,
+                  len,
+                  0,
+                  &udp_srvr->client_sock_addr,
+                  sizeof(udp_srvr->client_sock_addr));
+}
+
+/*
+ * Answer a windows request with the finished windows of the requested
+ * sensors, the windows of as many sensors as fit in the tx buffer.
+ *
+ */
+static int udp_sensor_server_send_windows(struct udp_sensor_server* udp_srvr,
+                                          const struct sensors_wire_header* req,
+                                          struct sensors_wire_header* resp)
+{
+    struct sensors_wire_window* recs =
+        (struct sensors_wire_window*)(udp_srvr->tx_buffer + sizeof(*resp));
+    size_t room = (sizeof(udp_srvr->tx_buffer) - sizeof(*resp)) /
+                  sizeof(*recs);
+    struct sensors_mask mask;
+
+    if (udp_sensor_server_ids_mask(udp_srvr, req, &mask) < 0) {
+        resp->type = SENSORS_WIRE_TYPE_ERROR;
+        memcpy(udp_srvr->tx_buffer, resp, sizeof(*resp));
+        return sendto(udp_srvr->sock,
+                      udp_srvr->tx_buffer,
+                      sizeof(*resp),
+                      0,
+                      &udp_srvr->client_sock_addr,
+                      sizeof(udp_srvr->client_sock_addr));
+    }
+
+    resp->type = SENSORS_WIRE_TYPE_WINDOWS;
+
+    for (int i = sensors_mask_next(&mask, 0); i >= 0;
+         i = sensors_mask_next(&mask, i + 1)) {
+        struct sensors_cache_window
+            windows[CONFIG_SENSORS_CACHE_AGGREGATE_WINDOWS];
+
+        int cnt = sensors_cache_get_windows((enum sensor)i,
+                                            req->from_ms,
+                                            windows,
+                                            sizeof(windows) /
+                                                sizeof(windows[0]));
+        if (cnt < 0) {
+            continue;
+        }
+
+        if (resp->count + cnt > room) {
+            resp->flags |= SENSORS_WIRE_FLAG_TRUNCATED;
+            break;
+        }
+
+        for (int j = 0; j < cnt; j++) {
+            const struct sensors_cache_window* win = &windows[j];
+            struct sensors_wire_window rec = {
+                .id = i,
+                .min = win->min,
+                .max = win->max,
+                .mean = (win->sum + win->count / 2) / win->count,
+                .start_ms = win->start_ms,
+                .len_ms = CONFIG_SENSORS_CACHE_AGGREGATE_WINDOW_MS,
+                .count = win->count,
+            };
+            memcpy(&recs[resp->count++], &rec, sizeof(rec));
+        }
+    }
+
+    memcpy(udp_srvr->tx_buffer, resp, sizeof(*resp));
+
+    return sendto(udp_srvr->sock,
+                  udp_srvr->tx_buffer,
+                  sizeof(*resp) + resp->count * sizeof(*recs),
+                  0,
+                  &udp_srvr->client_sock_addr,
+                  sizeof(udp_srvr->client_sock_addr));
+}
+
+/*
+ * Answer a binary request (see sensors_wire.h) with a record per requested
+ * sensor, or with an error header if the request is malformed or asks for
+ * unknown sensors.
+ *
+ */
+static int udp_sensor_server_handle_binary_request(
+    struct udp_sensor_server* udp_srvr)
+{
+    struct sensors_wire_header req;
+    memcpy(&req, udp_srvr->rx_buffer, sizeof(req));
+
+    size_t ids_cnt = udp_srvr->rx_len < sizeof(req)
+        ? 0
+        : (udp_srvr->rx_len - sizeof(req)) / sizeof(uint16_t);
+
+    TickType_t now = xTaskGetTickCount();
+    struct sensors_wire_header resp = {
+        .magic = SENSORS_WIRE_MAGIC,
+        .version = SENSORS_WIRE_VERSION,
+        .type = SENSORS_WIRE_TYPE_RESPONSE,
+        .hub_ms = pdTICKS_TO_MS(now),
+        .boot_id = sensors_cache_boot_id(),
+    };
+
+    if (udp_srvr->rx_len < sizeof(req) ||
+        req.version != SENSORS_WIRE_VERSION) {
+        LOG_ERR("Invalid binary request");
+        resp.type = SENSORS_WIRE_TYPE_ERROR;
+    } else if (req.type == SENSORS_WIRE_TYPE_DELTA_REQUEST) {
+        struct sensors_wire_record* recs =
+            (struct sensors_wire_record*)(udp_srvr->tx_buffer + sizeof(resp));
+
+        uint32_t cache_version;
+
+        resp.count = sensors_cache_get_changes(
+            req.boot_id, req.cache_version, now, recs, &cache_version);
+        resp.cache_version = cache_version;
+        if (resp.count == 0) {
+            resp.type = SENSORS_WIRE_TYPE_NOT_MODIFIED;
+        }
+    } else if (req.type == SENSORS_WIRE_TYPE_HISTORY_REQUEST) {
+        if (udp_srvr->rx_len <
+            sizeof(req) + sizeof(struct sensors_wire_history_request)) {
+            LOG_ERR("Invalid history request");
+            resp.type = SENSORS_WIRE_TYPE_ERROR;
+        } else {
+            return udp_sensor_server_send_history(udp_srvr, &resp);
+        }
+    } else if (req.type == SENSORS_WIRE_TYPE_WINDOWS_REQUEST &&
+               req.count <= ids_cnt) {
+        return udp_sensor_server_send_windows(udp_srvr, &req, &resp);
+    } else if ((req.type != SENSORS_WIRE_TYPE_REQUEST &&
+                req.type != SENSORS_WIRE_TYPE_SUBSCRIBE) ||
+               req.count > ids_cnt) {
+        LOG_ERR("Invalid binary request");
+        resp.type = SENSORS_WIRE_TYPE_ERROR;
+    } else if (req.type == SENSORS_WIRE_TYPE_SUBSCRIBE &&
+               udp_sensor_server_subscribe(udp_srvr, &req) < 0) {
+        resp.type = SENSORS_WIRE_TYPE_ERROR;
+    } else if (req.type == SENSORS_WIRE_TYPE_REQUEST &&
+               (req.flags & SENSORS_WIRE_FLAG_MAX_AGE) &&
+               udp_sensor_server_park(udp_srvr, &req, now)) {
+        return 0;
+    } else if (req.count == 0) {
+        return udp_sensor_server_send_snapshot(udp_srvr, now);
+    } else {
+        udp_sensor_server_read_ids(udp_srvr, &req, now, &resp);
+    }
+
+    memcpy(udp_srvr->tx_buffer, &resp, sizeof(resp));
+
+    return sendto(udp_srvr->sock,
+                  udp_srvr->tx_buffer,
+                  SENSORS_WIRE_RESPONSE_LEN(resp.count),
+                  0,
+                  &udp_srvr->client_sock_addr,
+                  sizeof(udp_srvr->client_sock_addr));
+}
+
 static int udp_sensor_server_handle_request(struct udp_sensor_server* udp_srvr)
 {
+    if (udp_sensor_server_is_binary_request(udp_srvr)) {
+        return udp_sensor_server_handle_binary_request(udp_srvr);
+    }
+
+    if (udp_sensor_server_is_batch_request(udp_srvr->rx_buffer)) {
+        return udp_sensor_server_handle_batch_request(udp_srvr);
+    }
+
     uint8_t code = udp_srvr->rx_buffer[0];
     code -= (uint8_t)'0';
 
     sensor_val_t val = {0};
-    enum sensor sens_id = (enum sensor)code;
 
-    if (sens_id >= SENSOR_NONE) {
+    if (sensors_cache_get((enum sensor)code, &val) < 0) {
         LOG_ERR("Invalid sensor ID %c", udp_srvr->rx_buffer[0]);
-    } else {
-        sensors_cache_get(sens_id, &val);
     }
 
     char response_str[32] = {0};
-    snprintf(response_str,
-             sizeof(response_str),
-             "sensor_value=%d\n",
-             val.u16);
+    int len = snprintf(response_str,
+                       sizeof(response_str),
+                       "sensor_value=%d\n",
+                       val.u16);
 
     return sendto(udp_srvr->sock,
                   response_str,
-                  sizeof(response_str),
+                  len,
                   0,
                   &udp_srvr->client_sock_addr,
                   sizeof(udp_srvr->client_sock_addr));
 }
 
+/*
+ * Wait until there are requests to read, for @p timeout at most (forever if
+ * NULL).
+ *
+ * @return > 0 if there are requests, 0 on timeout and < 0 on error.
+ */
+static int udp_sensor_server_wait_for_requests(
+    struct udp_sensor_server* udp_srvr,
+    struct timeval* timeout)
+{
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(udp_srvr->sock, &read_fds);
+
+    return select(udp_srvr->sock + 1, &read_fds, NULL, NULL, timeout);
+}
+
+/*
+ * Answer all the pending requests.
+ *
+ * @return The number of requests answered, or < 0 on error.
+ */
+static int udp_sensor_server_drain_requests(struct udp_sensor_server* udp_srvr)
+{
+    int handled = 0;
+
+    for (;;) {
+        int len = udp_sensor_server_read_request(udp_srvr);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return handled;
+            }
+
+            LOG_ERR("recvfrom failed, error %d", errno);
+            return -1;
+        }
+
+        int rc = udp_sensor_server_handle_request(udp_srvr);
+        if (rc < 0) {
+            LOG_ERR("Error occurred during sending: errno %d", errno);
+            return -1;
+        }
+
+        handled++;
+        atomic_add(&udp_srvr->requests, 1);
+    }
+}
+
+/*
+ * Size the next serving window: the busier the clients, the longer it is.
+ * It's half of the max. at CONFIG_UDP_SENSOR_SERVER_WINDOW_HALF_RATE
+ * requests/min, and it's divided among the remotes still to be found, so
+ * that they are scanned for sooner.
+ *
+ */
+static uint32_t udp_sensor_server_pick_window(
+    const struct udp_sensor_server* udp_srvr,
+    uint32_t max_ms,
+    size_t missing_remotes)
+{
+    if (!ADAPTIVE_WINDOW_ENABLED || max_ms <= MIN_WINDOW_MS) {
+        return max_ms;
+    }
+
+    uint32_t rate = udp_srvr->duty_cycle.req_per_min;
+    uint64_t window_ms = MIN_WINDOW_MS +
+        (uint64_t)(max_ms - MIN_WINDOW_MS) * rate / (rate + WINDOW_HALF_RATE);
+
+    window_ms /= 1 + missing_remotes;
+
+    return window_ms < MIN_WINDOW_MS ? MIN_WINDOW_MS : (uint32_t)window_ms;
+}
+
+/*
+ * A window ends after this long without requests: CONFIG_UDP_SENSOR_SERVER_
+ * IDLE_MS, or twice the mean time between requests, if longer, so that
+ * clients polling steadily are not left out.
+ *
+ */
+static uint32_t udp_sensor_server_idle_ms(
+    const struct udp_sensor_server* udp_srvr)
+{
+    uint32_t rate = udp_srvr->duty_cycle.req_per_min;
+    if (rate == 0) {
+        return IDLE_MS;
+    }
+
+    uint32_t idle_ms = 2 * 60000 / rate;
+    return idle_ms < IDLE_MS ? IDLE_MS : idle_ms;
+}
+
+/*
+ * Account for the window that just ended, and for the BLE phase before it,
+ * in the request rate.
+ *
+ */
+static void udp_sensor_server_window_done(struct udp_sensor_server* udp_srvr,
+                                          TickType_t start,
+                                          TickType_t end,
+                                          bool idle)
+{
+    struct udp_sensor_server_duty_cycle* dc = &udp_srvr->duty_cycle;
+
+    uint32_t requests = atomic_get(&udp_srvr->requests).u32;
+    uint32_t cycle_ms = pdTICKS_TO_MS(end - udp_srvr->window_end);
+    uint64_t rate_x16 = 0;
+
+    // The average is kept x16 so that low rates don't round down to 0
+    if (cycle_ms > 0) {
+        rate_x16 = (uint64_t)(requests - udp_srvr->requests_at_window_end) *
+            60000 * 16 / cycle_ms;
+        rate_x16 = MIN(rate_x16, UINT32_MAX);
+    }
+
+    udp_srvr->req_rate_x16 = udp_srvr->req_rate_x16 -
+        (udp_srvr->req_rate_x16 >> UDP_SENSOR_SERVER_RATE_EWMA_SHIFT) +
+        ((uint32_t)rate_x16 >> UDP_SENSOR_SERVER_RATE_EWMA_SHIFT);
+    dc->req_per_min = (udp_srvr->req_rate_x16 + 8) >> 4;
+    dc->poll_ms = pdTICKS_TO_MS(start - udp_srvr->window_end);
+    dc->served_ms = pdTICKS_TO_MS(end - start);
+    dc->windows++;
+    if (idle) {
+        dc->idle_ends++;
+    }
+
+    udp_srvr->requests_at_window_end = requests;
+    udp_srvr->window_end = end;
+
+    LOG_DBG("window %lu/%lu ms after %lu ms of polling, %lu req/min%s",
+            dc->served_ms,
+            dc->window_ms,
+            dc->poll_ms,
+            dc->req_per_min,
+            idle ? " (idle)" : "");
+}
+
 static void udp_sensor_server_close_socket(struct udp_sensor_server* udp_srvr)
 {
     if (udp_srvr->sock == -1) {
@@ -131,49 +998,250 @@ static void udp_sensor_server_close_socket(struct udp_sensor_server* udp_srvr)
     udp_srvr->sock = -1;
 }
 
-void udp_sensor_server_accept_requests(struct udp_sensor_server* udp_srvr,
-                                       uint32_t period_ms)
+/*
+ * Create the socket, retrying every UDP_SENSOR_SERVER_RETRY_MS until it can
+ * be (e.g. until the network interface is up).
+ *
+ */
+static void udp_sensor_server_open_socket(struct udp_sensor_server* udp_srvr)
+{
+    while (udp_sensor_server_get_socket(udp_srvr) < 0) {
+        LOG_ERR("Unable to create socket: errno %d", errno);
+        udp_sensor_server_close_socket(udp_srvr);
+        vTaskDelay(pdMS_TO_TICKS(UDP_SENSOR_SERVER_RETRY_MS));
+    }
+}
+
+/*
+ * Serve requests forever. Values are read from the (thread-safe) sensors
+ * cache, so this runs concurrently with the BLE polling. If select() fails,
+ * the socket is created again after a while rather than retried right away.
+ *
+ */
+static void udp_sensor_server_serve_forever(struct udp_sensor_server* udp_srvr)
 {
-    int rc = udp_sensor_server_get_socket(udp_srvr, period_ms);
+    udp_sensor_server_open_socket(udp_srvr);
+
+    LOG_INF("UDP server listening on port %d, core %d",
+            udp_srvr->port,
+            xPortGetCoreID());
+
+    for (;;) {
+        // While there are parked requests, check for fresh values regularly
+        struct timeval timeout =
+            udp_sensor_server_get_timeval(UDP_SENSOR_SERVER_PARKED_POLL_MS);
+
+        int rc = udp_sensor_server_wait_for_requests(
+            udp_srvr, udp_srvr->parked_cnt > 0 ? &timeout : NULL);
+        if (rc < 0 && errno != EINTR) {
+            LOG_ERR("select failed, error %d", errno);
+            udp_sensor_server_close_socket(udp_srvr);
+            vTaskDelay(pdMS_TO_TICKS(UDP_SENSOR_SERVER_RETRY_MS));
+            udp_sensor_server_open_socket(udp_srvr);
+        }
 
+        if (rc > 0) {
+            udp_sensor_server_drain_requests(udp_srvr);
+        }
+
+        if (udp_srvr->parked_cnt > 0) {
+            udp_sensor_server_serve_parked(udp_srvr);
+        }
+    }
+}
+
+/*
+ * Serve the window picked by @ref udp_sensor_server_accept_requests. The
+ * socket stays bound between windows, so the requests received during the BLE
+ * phase are queued (CONFIG_LWIP_UDP_RECVMBOX_SIZE of them at most, the rest
+ * are dropped by lwIP) and answered as soon as the window opens; they count
+ * towards the request rate like the others. The socket is only created again
+ * after an error.
+ *
+ */
+static void udp_sensor_server_serve_window(struct udp_sensor_server* udp_srvr)
+{
+    TickType_t start = xTaskGetTickCount();
+    uint32_t window_ms = udp_srvr->duty_cycle.window_ms;
+    uint32_t idle_ms = udp_sensor_server_idle_ms(udp_srvr);
+    bool idle = false;
+
+    if (udp_srvr->sock < 0 && udp_sensor_server_get_socket(udp_srvr) < 0) {
+        LOG_ERR("Unable to create socket: errno %d", errno);
+        udp_sensor_server_close_socket(udp_srvr);
+        udp_sensor_server_window_done(
+            udp_srvr, start, xTaskGetTickCount(), false);
+        return;
+    }
+
+    int rc = udp_sensor_server_drain_requests(udp_srvr);
     if (rc < 0) {
-        LOG_ERR("Unable to create socket: error %d", udp_srvr->sock);
+        udp_sensor_server_close_socket(udp_srvr);
+        udp_sensor_server_window_done(
+            udp_srvr, start, xTaskGetTickCount(), false);
         return;
     }
 
-    TickType_t start_tick = xTaskGetTickCount();
-    uint32_t elapsed_ms = pdTICKS_TO_MS(xTaskGetTickCount() - start_tick);
+    udp_srvr->duty_cycle.queued = rc;
+    if (rc > 0) {
+        LOG_DBG("%d queued requests answered", rc);
+    }
 
-    while (elapsed_ms < period_ms) {
-        LOG_DBG("waiting for requests - [elapsed = %lu, timeout  = %lu]",
-                elapsed_ms,
-                period_ms);
+    // A single deadline for the whole period; each wakeup answers all the
+    // requests received meanwhile. With the adaptive window, it also ends
+    // after idle_ms without requests.
+    TickType_t deadline = start + pdMS_TO_TICKS(window_ms);
+    TickType_t idle_deadline = start + pdMS_TO_TICKS(idle_ms);
 
-        int len = udp_sensor_server_wait_for_request(udp_srvr);
+    for (;;) {
+        TickType_t now = xTaskGetTickCount();
 
-        if (len < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                LOG_ERR("recvfrom failed, error %d", errno);
-                break;
-            } else {
-                elapsed_ms = pdTICKS_TO_MS(xTaskGetTickCount() - start_tick);
-                udp_sensor_server_set_timeout(udp_srvr, period_ms - elapsed_ms);
-                continue;
-            }
+        int32_t left_ticks = (int32_t)(deadline - now);
+        if (ADAPTIVE_WINDOW_ENABLED &&
+            (int32_t)(idle_deadline - now) < left_ticks) {
+            left_ticks = (int32_t)(idle_deadline - now);
+            idle = true;
+        } else {
+            idle = false;
         }
 
-        rc = udp_sensor_server_handle_request(udp_srvr);
+        if (left_ticks <= 0) {
+            break;
+        }
+
+        struct timeval timeout =
+            udp_sensor_server_get_timeval(pdTICKS_TO_MS(left_ticks));
+
+        rc = udp_sensor_server_wait_for_requests(udp_srvr, &timeout);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
 
         if (rc < 0) {
-            LOG_ERR("Error occurred during sending: errno %d", errno);
+            LOG_ERR("select failed, error %d", errno);
+            udp_sensor_server_close_socket(udp_srvr);
+            idle = false;
+            break;
+        }
+
+        if (rc == 0) {
+            break;
+        }
+
+        rc = udp_sensor_server_drain_requests(udp_srvr);
+        if (rc < 0) {
+            udp_sensor_server_close_socket(udp_srvr);
+            idle = false;
             break;
         }
 
-        elapsed_ms = pdTICKS_TO_MS(xTaskGetTickCount() - start_tick);
-        udp_sensor_server_set_timeout(udp_srvr, period_ms - elapsed_ms);
+        LOG_DBG("%d requests answered", rc);
+
+        idle_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(idle_ms);
     }
 
-    udp_sensor_server_close_socket(udp_srvr);
+    udp_sensor_server_window_done(udp_srvr, start, xTaskGetTickCount(), idle);
+}
+
+/*
+ * Serve requests, either forever or in the windows opened by
+ * @ref udp_sensor_server_accept_requests. In the latter case, the window end
+ * functor is executed once each of them is over.
+ *
+ */
+static void udp_sensor_server_task(void* args)
+{
+    struct udp_sensor_server* udp_srvr = (struct udp_sensor_server*)args;
+
+    if (ALWAYS_ON_ENABLED) {
+        udp_sensor_server_serve_forever(udp_srvr);
+    }
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        udp_sensor_server_serve_window(udp_srvr);
+        atomic_store(&udp_srvr->window_open, false);
+
+        struct udp_window_end_functor* functor = udp_srvr->window_end_functor;
+        if (functor != NULL) {
+            functor->handler(functor->user_args);
+        }
+    }
+}
+
+bool udp_sensor_server_accept_requests(struct udp_sensor_server* udp_srvr,
+                                       uint32_t max_period_ms,
+                                       size_t missing_remotes)
+{
+    if (ALWAYS_ON_ENABLED) {
+        // Requests are served meanwhile: just account for the cycle
+        TickType_t now = xTaskGetTickCount();
+
+        udp_srvr->duty_cycle.window_ms = max_period_ms;
+        udp_sensor_server_window_done(udp_srvr, now, now, false);
+        return false;
+    }
+
+    if (udp_srvr->task == NULL) {
+        return false;
+    }
+
+    // Its end will be notified as well
+    if (atomic_load(&udp_srvr->window_open)) {
+        return true;
+    }
+
+    udp_srvr->duty_cycle.window_ms = udp_sensor_server_pick_window(
+        udp_srvr, max_period_ms, missing_remotes);
+
+    atomic_store(&udp_srvr->window_open, true);
+    xTaskNotifyGive(udp_srvr->task);
+    return true;
+}
+
+void udp_sensor_server_get_duty_cycle(
+    const struct udp_sensor_server* udp_srvr,
+    struct udp_sensor_server_duty_cycle* duty_cycle)
+{
+    *duty_cycle = udp_srvr->duty_cycle;
+}
+
+void udp_sensor_server_log_stats(const struct udp_sensor_server* udp_srvr)
+{
+    const struct udp_sensor_server_duty_cycle* dc = &udp_srvr->duty_cycle;
+
+    LOG_INF("%lu requests, %lu req/min; last window %lu ms (%lu ms picked, "
+            "%lu requests queued) after %lu ms of BLE polling; %lu/%lu "
+            "windows ended idle",
+            atomic_get(&udp_srvr->requests).u32,
+            dc->req_per_min,
+            dc->served_ms,
+            dc->window_ms,
+            dc->queued,
+            dc->poll_ms,
+            dc->idle_ends,
+            dc->windows);
+}
+
+void udp_sensor_server_set_refresh_functor(
+    struct udp_sensor_server* udp_srvr,
+    struct sensor_refresh_functor* refresh_functor)
+{
+    udp_srvr->refresh_functor = refresh_functor;
+}
+
+void udp_sensor_server_refresh_failed(struct udp_sensor_server* udp_srvr,
+                                      enum sensor s)
+{
+    atomic_fetch_or(&udp_srvr->refresh_failed[s / 32], 1UL << (s % 32));
+}
+
+void udp_sensor_server_set_window_end_functor(
+    struct udp_sensor_server* udp_srvr,
+    struct udp_window_end_functor* window_end_functor)
+{
+    udp_srvr->window_end_functor = window_end_functor;
 }
 
 void udp_sensor_server_setup(struct udp_sensor_server* udp_srvr, uint16_t port)
@@ -191,4 +1259,21 @@ void udp_sensor_server_setup(struct udp_sensor_server* udp_srvr, uint16_t port)
 
     udp_srvr->sock = -1;
     udp_srvr->port = port;
+    udp_srvr->window_end = xTaskGetTickCount();
+    atomic_init(&udp_srvr->window_open, false);
+    for (int i = 0; i < SENSORS_MASK_WORDS; i++) {
+        atomic_init(&udp_srvr->refresh_failed[i], 0);
+    }
+
+    BaseType_t rc = xTaskCreatePinnedToCore(udp_sensor_server_task,
+                                            "udp_srvr",
+                                            UDP_SENSOR_SERVER_TASK_STACK_SIZE,
+                                            udp_srvr,
+                                            UDP_SENSOR_SERVER_TASK_PRIORITY,
+                                            &udp_srvr->task,
+                                            CONFIG_UDP_SENSOR_SERVER_CORE);
+    if (rc != pdPASS) {
+        LOG_ERR("could not create the UDP server task");
+        udp_srvr->task = NULL;
+    }
 }
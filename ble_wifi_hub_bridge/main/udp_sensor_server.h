@@ -1,34 +1,188 @@
 #ifndef UDP_SENSOR_SERVER_H
 #define UDP_SENSOR_SERVER_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+
 #include <lwip/err.h>
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
 #include <lwip/netdb.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "atomic.h"
+#include "sensors_cache.h"
+
+#define UDP_SENSOR_SERVER_MAX_PARKED 8
+
+// Longest history response: the sensor ID and two varints per sample.
+#define UDP_SENSOR_SERVER_HISTORY_LEN                                         \
+    (sizeof(struct sensors_wire_header) + sizeof(uint16_t) +                  \
+     CONFIG_SENSORS_CACHE_HISTORY_LEN * 2 * SENSORS_WIRE_VARINT_MAX_LEN)
+
+// Room for a response with all the sensors, or for a whole history.
+#define UDP_SENSOR_SERVER_TX_LEN                                              \
+    (SENSORS_WIRE_RESPONSE_LEN(SENSORS_CACHE_MAX_SENSORS) >                   \
+             UDP_SENSOR_SERVER_HISTORY_LEN                                    \
+         ? SENSORS_WIRE_RESPONSE_LEN(SENSORS_CACHE_MAX_SENSORS)               \
+         : UDP_SENSOR_SERVER_HISTORY_LEN)
+
+typedef void (*sensor_refresh_handler_t)(enum sensor s, void* user_args);
+
+/**
+ * @brief Sensor refresh functor: asks for a sensor to be read as soon as
+ * possible.
+ */
+struct sensor_refresh_functor
+{
+    sensor_refresh_handler_t handler;
+    void* user_args;
+};
+
+typedef void (*udp_window_end_handler_t)(void* user_args);
+
+/**
+ * @brief Window end functor: executed by the server task when a serving
+ * window opened by @ref udp_sensor_server_accept_requests is over.
+ */
+struct udp_window_end_functor
+{
+    udp_window_end_handler_t handler;
+    void* user_args;
+};
+
+/**
+ * @brief Request waiting for its sensors to be refreshed.
+ *
+ */
+struct udp_sensor_server_parked_req
+{
+    struct sockaddr client_sock_addr;
+    struct sensors_mask sensors_mask;
+    uint32_t max_age_ms;
+    TickType_t deadline;
+    struct sensors_mask failed; // Sensors whose refresh failed meanwhile
+    bool used;
+};
+
+/**
+ * @brief Split between serving and BLE polling picked by the server.
+ *
+ */
+struct udp_sensor_server_duty_cycle
+{
+    uint32_t window_ms;   // Last serving window picked
+    uint32_t served_ms;   // How long it actually lasted
+    uint32_t poll_ms;     // BLE phase before it
+    uint32_t req_per_min; // Measured request rate (moving average)
+    uint32_t queued;      // Requests waiting when the last window opened
+    uint32_t windows;
+    uint32_t idle_ends;   // Windows ended early for being idle
+};
+
 struct udp_sensor_server
 {
     int sock;
     char rx_buffer[128];
+    size_t rx_len;
+    char tx_buffer[UDP_SENSOR_SERVER_TX_LEN];
     struct sockaddr_in sever_sock_addr;
     struct sockaddr client_sock_addr;
     uint16_t port;
+    struct sensor_refresh_functor* refresh_functor;
+    struct udp_sensor_server_parked_req parked[UDP_SENSOR_SERVER_MAX_PARKED];
+    size_t parked_cnt;
+    atomic_uint_least32_t refresh_failed[SENSORS_MASK_WORDS];
+    struct udp_window_end_functor* window_end_functor;
+    TaskHandle_t task;
+    atomic_bool window_open;
+    atomic_t requests; // Counted by the server task, read by the BLE one
+    uint32_t requests_at_window_end;
+    uint32_t req_rate_x16; // Request rate moving average, x16 fixed point
+    TickType_t window_end;
+    struct udp_sensor_server_duty_cycle duty_cycle;
+    struct sensors_cache_snapshot snap;
+    struct sensors_cache_sample history[CONFIG_SENSORS_CACHE_HISTORY_LEN];
 };
 
 /**
- * @brief Setup an UDP server to listen on port @p port. This function only
- * sets up the server; call @ref udp_sensor_server_accept_requests to listen
- * for requests.
+ * @brief Setup an UDP server to listen on port @p port. This function starts
+ * the server task, pinned to CONFIG_UDP_SENSOR_SERVER_CORE. With
+ * CONFIG_UDP_SENSOR_SERVER_ALWAYS_ON, it listens for requests continuously;
+ * otherwise, call @ref udp_sensor_server_accept_requests to listen for them.
  *
  */
 void udp_sensor_server_setup(struct udp_sensor_server* udp_srvr, uint16_t port);
 
 /**
- * @brief Blocking function. Accept UDP requests to read sensor values during
- * @p period_ms milliseconds.
+ * @brief Set the functor called when a request with a max. age finds a
+ * sensor older than that. With CONFIG_UDP_SENSOR_SERVER_ALWAYS_ON, such
+ * requests are then answered as soon as their sensors are refreshed, or after
+ * CONFIG_UDP_SENSOR_SERVER_READ_THROUGH_TIMEOUT_MS, or once their refreshes
+ * failed (see @ref udp_sensor_server_refresh_failed), whatever comes first,
+ * with the values there are and their ages; otherwise, or without a functor,
+ * they are answered right away.
+ *
+ */
+void udp_sensor_server_set_refresh_functor(
+    struct udp_sensor_server* udp_srvr,
+    struct sensor_refresh_functor* refresh_functor);
+
+/**
+ * @brief Thread-safe. Report that the refresh of sensor @p s asked for by the
+ * refresh functor failed, so that the requests waiting for it don't wait for
+ * CONFIG_UDP_SENSOR_SERVER_READ_THROUGH_TIMEOUT_MS in vain.
+ *
+ */
+void udp_sensor_server_refresh_failed(struct udp_sensor_server* udp_srvr,
+                                      enum sensor s);
+
+/**
+ * @brief Set the functor executed when a serving window is over.
+ *
+ */
+void udp_sensor_server_set_window_end_functor(
+    struct udp_sensor_server* udp_srvr,
+    struct udp_window_end_functor* window_end_functor);
+
+/**
+ * @brief Non-blocking function. Open a window for the server task to accept
+ * UDP requests to read sensor values during @p max_period_ms milliseconds at
+ * most. The window end functor is executed once it's over.
+ *
+ * With CONFIG_UDP_SENSOR_SERVER_ADAPTIVE_WINDOW, the window is sized from the
+ * measured request rate: from CONFIG_UDP_SENSOR_SERVER_MIN_WINDOW_MS when
+ * nobody asks, up to @p max_period_ms (i.e. until the next sensor is due) as
+ * the rate grows. It's shortened while @p missing_remotes are still to be
+ * found, so that they are scanned for sooner, and it ends early once no
+ * request has been received for a while.
+ *
+ * With CONFIG_UDP_SENSOR_SERVER_ALWAYS_ON, requests are always accepted, so
+ * no window is opened: this function just accounts for the cycle, and the
+ * caller keeps its pace for @p max_period_ms milliseconds by itself.
+ *
+ * @return Whether a window is open, i.e. the window end functor will be
+ * executed.
+ */
+bool udp_sensor_server_accept_requests(struct udp_sensor_server* udp_srvr,
+                                       uint32_t max_period_ms,
+                                       size_t missing_remotes);
+
+/**
+ * @brief Get the split between serving and BLE polling picked last, and the
+ * request rate it was picked from.
+ *
+ */
+void udp_sensor_server_get_duty_cycle(
+    const struct udp_sensor_server* udp_srvr,
+    struct udp_sensor_server_duty_cycle* duty_cycle);
+
+/**
+ * @brief Log the duty cycle (see @ref udp_sensor_server_get_duty_cycle).
  *
  */
-void udp_sensor_server_accept_requests(
-    struct udp_sensor_server* udp_srvr, uint32_t period_ms);
+void udp_sensor_server_log_stats(const struct udp_sensor_server* udp_srvr);
 
 #endif /* UDP_SENSOR_SERVER_H */